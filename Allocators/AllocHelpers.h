@@ -1,9 +1,33 @@
 #pragma once
 #include <memory>
 #include <stdexcept>
+#include <cstdint>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <algorithm>
 
+#ifdef _WIN32
 #define NOMINMAX = 1
 #include <Windows.h>
+#pragma comment(lib, "Synchronization.lib")
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#include <cstdio>
+#endif
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 #include <list>
 #include <cstdlib>
 #include <stdlib.h>
@@ -15,20 +39,214 @@ namespace alloc
 using byte			= unsigned char;
 using bad_dealloc	= std::bad_alloc;
 
-// TODO: Linux #ifdef
 inline size_t pageSize()
 {
+#ifdef _WIN32
 	static SYSTEM_INFO systemInfo;
 	auto l = [&]() 
 	{
 		GetSystemInfo(&systemInfo); 
 		return systemInfo.dwPageSize;
 	};
+#else
+	auto l = []() { return static_cast<size_t>(sysconf(_SC_PAGESIZE)); };
+#endif
 	static size_t pgSz = l();
 		
 	return pgSz;
 }
 
+// Map bytes (rounded up to whole pages) straight from the OS.
+// Fresh pages are always zero filled, which lets 
+// callers skip clearing them
+//
+// prefault:	Fault every page in now instead of on first touch
+// lock:		Pin the pages in memory (best effort, limited by the OS quota)
+inline byte* osAlloc(size_t bytes, bool prefault = false, bool lock = false)
+{
+#ifdef _WIN32
+	void* mem = VirtualAlloc(nullptr, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	if (!mem)
+		throw std::bad_alloc();
+
+	if (lock)
+		VirtualLock(mem, bytes);
+
+	// Writing zeros keeps the pages zero filled
+	if (prefault && !lock)
+		for (size_t i = 0; i < bytes; i += pageSize())
+			reinterpret_cast<volatile byte*>(mem)[i] = 0;
+#else
+	const int flags = MAP_PRIVATE | MAP_ANONYMOUS
+#ifdef MAP_POPULATE
+		| (prefault ? MAP_POPULATE : 0)
+#endif
+		;
+
+	void* mem = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (mem == MAP_FAILED)
+		throw std::bad_alloc();
+
+	if (lock)
+		mlock(mem, bytes);
+#endif
+	return reinterpret_cast<byte*>(mem);
+}
+
+inline void osFree(byte* mem, size_t bytes)
+{
+#ifdef _WIN32
+	VirtualFree(mem, 0, MEM_RELEASE);
+#else
+	munmap(mem, bytes);
+#endif
+}
+
+// Number of NUMA nodes on the machine (1 if we can't tell)
+inline int numaNodes()
+{
+	auto l = []()
+	{
+		int nodes = 1;
+#ifdef _WIN32
+		ULONG highest = 0;
+		if (GetNumaHighestNodeNumber(&highest))
+			nodes = static_cast<int>(highest) + 1;
+#elif defined(__linux__)
+		// Formatted as a range, "0" or "0-3"
+		if (FILE* f = std::fopen("/sys/devices/system/node/possible", "r"))
+		{
+			int first = 0, last = 0;
+			const int read = std::fscanf(f, "%d-%d", &first, &last);
+			if (read == 2)
+				nodes = last + 1;
+			std::fclose(f);
+		}
+#endif
+		return nodes;
+	};
+	static const int nodes = l();
+	return nodes;
+}
+
+// NUMA node of the CPU the calling thread is on right now
+inline int currentNumaNode()
+{
+	int node = 0;
+#ifdef _WIN32
+	PROCESSOR_NUMBER	proc;
+	USHORT				n = 0;
+	GetCurrentProcessorNumberEx(&proc);
+	if (GetNumaProcessorNodeEx(&proc, &n))
+		node = n;
+#elif defined(__linux__)
+	unsigned cpu = 0, n = 0;
+	if (!syscall(SYS_getcpu, &cpu, &n, nullptr))
+		node = static_cast<int>(n);
+#endif
+	return node < numaNodes() ? node : 0;
+}
+
+// Same as osAlloc, but ask for the pages to come from NUMA node node
+// (a preference, the OS falls back on other nodes when it's out of memory)
+inline byte* osAllocOnNode(size_t bytes, int node)
+{
+#ifdef _WIN32
+	void* mem = VirtualAllocExNuma(GetCurrentProcess(), nullptr, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, node);
+	if (!mem)
+		throw std::bad_alloc();
+	return reinterpret_cast<byte*>(mem);
+#else
+	byte* mem = osAlloc(bytes);
+#if defined(__linux__)
+	if (numaNodes() > 1 && node < 64)
+	{
+		unsigned long mask = 1ul << node;
+		syscall(SYS_mbind, mem, bytes, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0);
+	}
+#endif
+	return mem;
+#endif
+}
+
+// Drop the calling thread to the lowest scheduling priority
+// (used for background housekeeping threads)
+inline void lowerThreadPriority()
+{
+#ifdef _WIN32
+	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_LOWEST);
+#elif defined(__linux__)
+	sched_param param{};
+	pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+#endif
+}
+
+// Tell the CPU we're in a spin wait loop (pause on x86, yield on ARM).
+// Keeps a spinning hyperthread from starving its sibling
+inline void cpuRelax() noexcept
+{
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+	_mm_pause();
+#elif defined(_M_ARM64) || defined(_M_ARM)
+	__yield();
+#elif defined(__aarch64__) || defined(__arm__)
+	asm volatile("yield");
+#endif
+}
+
+// Park the calling thread while word == expected. Can return spuriously,
+// callers must re-check their condition in a loop
+inline void futexWait(std::atomic<int>& word, int expected) noexcept
+{
+	static_assert(sizeof(std::atomic<int>) == sizeof(int), "futex needs a plain int");
+#if defined(_WIN32)
+	WaitOnAddress(&word, &expected, sizeof(int), INFINITE);
+#elif defined(__linux__)
+	syscall(SYS_futex, reinterpret_cast<int*>(&word), FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+#else
+	if (word.load(std::memory_order_relaxed) == expected)
+		std::this_thread::yield();
+#endif
+}
+
+// Same as above but gives up after (roughly) timeout
+inline void futexWait(std::atomic<int>& word, int expected, std::chrono::nanoseconds timeout) noexcept
+{
+	if (timeout.count() <= 0)
+		return;
+#if defined(_WIN32)
+	// Round up so we never wake early and spin on a zero timeout
+	const auto ms = std::chrono::ceil<std::chrono::milliseconds>(timeout).count();
+	WaitOnAddress(&word, &expected, sizeof(int), static_cast<DWORD>(std::min<long long>(ms, INFINITE - 1)));
+#elif defined(__linux__)
+	timespec ts;
+	ts.tv_sec	= static_cast<time_t>(timeout.count() / 1000000000);
+	ts.tv_nsec	= static_cast<long>(timeout.count() % 1000000000);
+	syscall(SYS_futex, reinterpret_cast<int*>(&word), FUTEX_WAIT_PRIVATE, expected, &ts, nullptr, 0);
+#else
+	if (word.load(std::memory_order_relaxed) == expected)
+		std::this_thread::yield();
+#endif
+}
+
+inline void futexWakeOne(std::atomic<int>& word) noexcept
+{
+#if defined(_WIN32)
+	WakeByAddressSingle(&word);
+#elif defined(__linux__)
+	syscall(SYS_futex, reinterpret_cast<int*>(&word), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+#endif
+}
+
+inline void futexWakeAll(std::atomic<int>& word) noexcept
+{
+#if defined(_WIN32)
+	WakeByAddressAll(&word);
+#elif defined(__linux__)
+	syscall(SYS_futex, reinterpret_cast<int*>(&word), FUTEX_WAKE_PRIVATE, INT32_MAX, nullptr, nullptr, 0);
+#endif
+}
+
 // Note: Not in use!
 template<class T>
 inline T* alignedAlloc(size_t size, size_t alignment)
@@ -71,6 +289,128 @@ inline T* allocatePage(size_t bytes)
 	return alignedAlloc<T>(pgs, pgSize);
 }
 
+// Result of an allocate_at_least call (mirrors C++23's std::allocation_result).
+// count is the number of objects that actually fit in the
+// block returned, and is always >= the number requested
+template<class T>
+struct allocation_result
+{
+	T*		ptr;
+	size_t	count;
+};
+
+// Index of the lowest set bit, bits must not be 0
+inline int lowestSetBit(uint64_t bits) noexcept
+{
+#ifdef _MSC_VER
+	unsigned long idx;
+#ifdef _WIN64
+	_BitScanForward64(&idx, bits);
+#else
+	if (!_BitScanForward(&idx, static_cast<unsigned long>(bits)))
+	{
+		_BitScanForward(&idx, static_cast<unsigned long>(bits >> 32));
+		idx += 32;
+	}
+#endif
+	return static_cast<int>(idx);
+#else
+	return __builtin_ctzll(bits);
+#endif
+}
+
+// Index of the highest set bit, bits must not be 0
+inline int highestSetBit(uint64_t bits) noexcept
+{
+#ifdef _MSC_VER
+	unsigned long idx;
+#ifdef _WIN64
+	_BitScanReverse64(&idx, bits);
+#else
+	if (_BitScanReverse(&idx, static_cast<unsigned long>(bits >> 32)))
+		idx += 32;
+	else
+		_BitScanReverse(&idx, static_cast<unsigned long>(bits));
+#endif
+	return static_cast<int>(idx);
+#else
+	return 63 - __builtin_clzll(bits);
+#endif
+}
+
+// A pointer and an ABA counter packed into 64 bits so both
+// can be swapped with a single CAS. On 64 bit the tag lives in the
+// upper 16 bits (user space addresses only use 48), on 32 bit
+// the pointer and tag each get half
+class TaggedPtr
+{
+public:
+	using value_type = uint64_t;
+
+private:
+	static constexpr int		PtrBits = sizeof(void*) == 8 ? 48 : 32;
+	static constexpr value_type	PtrMask = (value_type{ 1 } << PtrBits) - 1;
+
+	value_type val;
+
+public:
+
+	TaggedPtr() noexcept :
+		val{ 0 }
+	{}
+
+	explicit TaggedPtr(value_type val) noexcept :
+		val{ val }
+	{}
+
+	TaggedPtr(void* ptr, value_type tag) noexcept :
+		val{ (static_cast<value_type>(reinterpret_cast<uintptr_t>(ptr)) & PtrMask) | (tag << PtrBits) }
+	{}
+
+	template<class T>
+	T* ptr()				const noexcept { return reinterpret_cast<T*>(static_cast<uintptr_t>(val & PtrMask)); }
+	value_type tag()		const noexcept { return val >> PtrBits; }
+	value_type raw()		const noexcept { return val; }
+};
+
+// RAII over a mutex's upgrade mode (lock_upgrade). upgrade() swaps it for
+// an exclusive lock without letting go, whichever is held is released on destruction
+template<class Mutex>
+class UpgradeLock
+{
+	Mutex&	mutex;
+	bool	exclusive;
+
+public:
+
+	explicit UpgradeLock(Mutex& mutex) :
+		mutex{		mutex	},
+		exclusive{	false	}
+	{
+		mutex.lock_upgrade();
+	}
+
+	~UpgradeLock()
+	{
+		if (exclusive)
+			mutex.unlock();
+		else
+			mutex.unlock_upgrade();
+	}
+
+	UpgradeLock(const UpgradeLock&)				= delete;
+	UpgradeLock& operator=(const UpgradeLock&)	= delete;
+
+	void upgrade()
+	{
+		if (exclusive)
+			return;
+
+		mutex.unlock_upgrade_and_lock();
+		exclusive = true;
+	}
+};
+
 struct CacheInfo
 {
 	CacheInfo(size_t size, size_t capacity, size_t objectSize, size_t objPerSlab)
@@ -0,0 +1,386 @@
+#pragma once
+#include <atomic>
+#include <thread>
+#include <cstdint>
+#include "AllocHelpers.h"
+#include "ThreadRegistry.h"
+
+#if defined(__linux__)
+#include <linux/membarrier.h>
+#include <sys/syscall.h>
+#endif
+
+namespace ImplBiasedMutex
+{
+
+#if defined(__linux__)
+inline bool registerMembarrier() noexcept
+{
+	return syscall(__NR_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0) == 0;
+}
+#endif
+
+// Whether we have a process wide barrier, if we don't
+// both sides of the lock fall back on regular fences
+inline bool asymmetricFences() noexcept
+{
+#if defined(_WIN32)
+	return true;
+#elif defined(__linux__)
+	static const bool available = registerMembarrier();
+	return available;
+#else
+	return false;
+#endif
+}
+
+// Owner side of the asymmetric Dekker. When the heavy barrier is
+// availible this only has to stop the compiler reordering the flag store
+// and the following load, the remote's heavyBarrier does the rest
+inline void lightBarrier() noexcept
+{
+	if (asymmetricFences())
+		std::atomic_signal_fence(std::memory_order_seq_cst);
+	else
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+// Remote side. Forces a full memory barrier on every thread
+// of the process, so once it returns any store the owner made
+// before its lightBarrier is visible to us (and vice versa)
+inline void heavyBarrier() noexcept
+{
+#if defined(_WIN32)
+	FlushProcessWriteBuffers();
+#elif defined(__linux__)
+	if (asymmetricFences())
+		syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0);
+	else
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+#else
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+#endif
+}
+
+constexpr int SPIN_LIMIT		= 64;
+constexpr uint32_t REBIAS_AFTER	= 1024; // Uncontended owner writes before the owner takes the bias back
+
+// Spin for a bit, then start giving the core away
+inline void backoff(int& spins) noexcept
+{
+	if (spins < SPIN_LIMIT)
+	{
+		++spins;
+		alloc::cpuRelax();
+	}
+	else
+		std::this_thread::yield();
+}
+
+} // End ImplBiasedMutex::
+
+namespace alloc
+{
+
+// A shared mutex biased towards the thread that constructed it (the owner).
+// Ownership is by ThreadRegistry index, so if the owner exits the next
+// thread to get its index inherits the bias.
+//
+// While biased the owner locks (shared or exclusive) with a plain store + compiler
+// barrier and a load, no read-modify-writes and no per thread registration.
+// The first other thread to lock revokes the bias: it takes the plain reader/writer
+// lock (remoteState), then pays for a process wide barrier once and waits for the owner
+// to leave. After that everyone, owner included, just uses the plain lock, until the owner
+// goes REBIAS_AFTER exclusive locks without seeing another thread and takes the bias back.
+//
+// Great when almost every lock comes from one thread (a SlabMulti Cache),
+// no worse than a plain spinning reader/writer lock when it doesn't
+//
+// Has the same upgrade mode as SharedMutex. Writers and upgraders also take
+// an upgrade lock, which is biased (and revoked) the same way
+class BiasedMutex
+{
+	enum OwnerState
+	{
+		Free,
+		Shared,
+		Exclusive
+	};
+
+	enum Bias
+	{
+		Biased,
+		Revoking,
+		Unbiased
+	};
+
+	static constexpr uint32_t WRITER = 1u << 31;
+
+	size_t					owner;			// ThreadRegistry index
+	std::atomic<int>		ownerFlag;		// Only set while the owner holds the lock through the bias
+	std::atomic<uint32_t>	remoteState;	// Plain lock, reader count | WRITER
+	std::atomic<bool>		ownerUpgrade;	// Upgrade lock, held by writers and upgraders
+	std::atomic<bool>		remoteUpgrade;
+	std::atomic<int>		lockBias;
+	std::atomic<int>		upgradeBias;
+	std::atomic<bool>		remoteSeen;		// Another thread locked since the owner last looked
+	uint32_t				ownerStreak;	// Only touched by the owner
+
+public:
+
+	BiasedMutex() noexcept :
+		owner{			ThreadRegistry::index()		},
+		ownerFlag{		Free						},
+		remoteState{	0							},
+		ownerUpgrade{	false						},
+		remoteUpgrade{	false						},
+		lockBias{		Biased						},
+		upgradeBias{	Biased						},
+		remoteSeen{		false						},
+		ownerStreak{	0							}
+	{}
+
+	BiasedMutex(BiasedMutex&& other) noexcept :
+		owner{			other.owner },
+		ownerFlag{		Free		},
+		remoteState{	0			},
+		ownerUpgrade{	false		},
+		remoteUpgrade{	false		},
+		lockBias{		Biased		},
+		upgradeBias{	Biased		},
+		remoteSeen{		false		},
+		ownerStreak{	0			}
+	{}
+
+	BiasedMutex(const BiasedMutex& other)				= delete;
+	BiasedMutex& operator=(const BiasedMutex& other)	= delete;
+
+	bool isOwner() const { return ThreadRegistry::index() == owner; }
+	bool biased() const { return lockBias.load(std::memory_order_relaxed) == Biased; }
+
+	void lock_shared() noexcept
+	{
+		if (isOwner())
+		{
+			if (!ownerLock(Shared, WRITER))
+				plainLockShared();
+			return;
+		}
+
+		plainLockShared();
+		revoke(lockBias, [&]() { return ownerFlag.load(std::memory_order_acquire) == Free; });
+	}
+
+	void unlock_shared() noexcept
+	{
+		if (isOwner() && ownerFlag.load(std::memory_order_relaxed) != Free)
+			ownerFlag.store(Free, std::memory_order_release);
+		else
+			remoteState.fetch_sub(1, std::memory_order_release);
+	}
+
+	void lock() noexcept
+	{
+		lockUpgradeWord();
+		lockExclusive();
+
+		if (isOwner())
+			tryRebias();
+	}
+
+	void unlock() noexcept
+	{
+		unlockExclusive();
+		unlockUpgradeWord();
+	}
+
+	void lock_upgrade() noexcept
+	{
+		lockUpgradeWord();
+		lock_shared();
+	}
+
+	void unlock_upgrade() noexcept
+	{
+		unlock_shared();
+		unlockUpgradeWord();
+	}
+
+	// No other writer can get in between, they all need the upgrade lock
+	void unlock_upgrade_and_lock() noexcept
+	{
+		unlock_shared();
+		lockExclusive();
+	}
+
+	void unlock_and_lock_upgrade() noexcept
+	{
+		if (isOwner() && ownerFlag.load(std::memory_order_relaxed) == Exclusive)
+			ownerFlag.store(Shared, std::memory_order_release);
+		else
+			remoteState.store(1, std::memory_order_release);
+	}
+
+private:
+
+	// Biased owner side of the asymmetric Dekker. Returns false if the bias
+	// is (being) revoked or a remote holds the plain lock, the caller should
+	// use the plain lock instead
+	bool ownerLock(OwnerState state, uint32_t conflicts) noexcept
+	{
+		if (lockBias.load(std::memory_order_relaxed) != Biased)
+			return false;
+
+		ownerFlag.store(state, std::memory_order_relaxed);
+		ImplBiasedMutex::lightBarrier();
+
+		if (lockBias.load(std::memory_order_relaxed) == Biased
+			&& !(remoteState.load(std::memory_order_acquire) & conflicts))
+			return true;
+
+		ownerFlag.store(Free, std::memory_order_release);
+		return false;
+	}
+
+	void lockUpgradeWord() noexcept
+	{
+		if (isOwner())
+		{
+			if (upgradeBias.load(std::memory_order_relaxed) == Biased)
+			{
+				ownerUpgrade.store(true, std::memory_order_relaxed);
+				ImplBiasedMutex::lightBarrier();
+
+				if (upgradeBias.load(std::memory_order_relaxed) == Biased
+					&& !remoteUpgrade.load(std::memory_order_acquire))
+					return;
+
+				ownerUpgrade.store(false, std::memory_order_release);
+			}
+			plainLockUpgrade();
+			return;
+		}
+
+		plainLockUpgrade();
+		revoke(upgradeBias, [&]() { return !ownerUpgrade.load(std::memory_order_acquire); });
+	}
+
+	void unlockUpgradeWord() noexcept
+	{
+		if (isOwner() && ownerUpgrade.load(std::memory_order_relaxed))
+			ownerUpgrade.store(false, std::memory_order_release);
+		else
+			remoteUpgrade.store(false, std::memory_order_release);
+	}
+
+	void lockExclusive() noexcept
+	{
+		if (isOwner())
+		{
+			if (!ownerLock(Exclusive, ~0u))
+				plainLock();
+			return;
+		}
+
+		plainLock();
+		revoke(lockBias, [&]() { return ownerFlag.load(std::memory_order_acquire) == Free; });
+	}
+
+	void unlockExclusive() noexcept
+	{
+		if (isOwner() && ownerFlag.load(std::memory_order_relaxed) != Free)
+			ownerFlag.store(Free, std::memory_order_release);
+		else
+			remoteState.store(0, std::memory_order_release);
+	}
+
+	void plainLockShared() noexcept
+	{
+		int spins		= 0;
+		uint32_t state	= remoteState.load(std::memory_order_relaxed);
+		for (;;)
+		{
+			if (state & WRITER)
+			{
+				ImplBiasedMutex::backoff(spins);
+				state = remoteState.load(std::memory_order_relaxed);
+				continue;
+			}
+
+			if (remoteState.compare_exchange_weak(state, state + 1, std::memory_order_acquire))
+				return;
+		}
+	}
+
+	void plainLock() noexcept
+	{
+		int spins		= 0;
+		uint32_t state	= 0;
+		while (!remoteState.compare_exchange_weak(state, WRITER, std::memory_order_acquire))
+		{
+			ImplBiasedMutex::backoff(spins);
+			state = 0;
+		}
+	}
+
+	void plainLockUpgrade() noexcept
+	{
+		int spins = 0;
+		while (remoteUpgrade.exchange(true, std::memory_order_acquire))
+			while (remoteUpgrade.load(std::memory_order_relaxed))
+				ImplBiasedMutex::backoff(spins);
+	}
+
+	// Called by a remote holding the plain lock. The first one in after the
+	// bias was given pays for the barrier and waits for the owner to leave,
+	// any others wait for it to finish
+	template<class Released>
+	void revoke(std::atomic<int>& bias, Released&& ownerReleased) noexcept
+	{
+		if (!remoteSeen.load(std::memory_order_relaxed))
+			remoteSeen.store(true, std::memory_order_relaxed);
+
+		int b = bias.load(std::memory_order_acquire);
+		if (b == Unbiased)
+			return;
+
+		int spins = 0;
+		if (b == Biased && bias.compare_exchange_strong(b, Revoking, std::memory_order_acq_rel))
+		{
+			// Once the barrier is done the owner will see Revoking
+			// before it can take the biased path again
+			ImplBiasedMutex::heavyBarrier();
+			while (!ownerReleased())
+				ImplBiasedMutex::backoff(spins);
+
+			bias.store(Unbiased, std::memory_order_release);
+			return;
+		}
+
+		while (bias.load(std::memory_order_acquire) != Unbiased)
+			ImplBiasedMutex::backoff(spins);
+	}
+
+	// Owner holding both words exclusively, so no remote can be inside
+	// either, and no revoke can be in progress
+	void tryRebias() noexcept
+	{
+		if (remoteSeen.load(std::memory_order_relaxed))
+		{
+			remoteSeen.store(false, std::memory_order_relaxed);
+			ownerStreak = 0;
+			return;
+		}
+
+		if (++ownerStreak < ImplBiasedMutex::REBIAS_AFTER)
+			return;
+
+		ownerStreak = 0;
+		if (ownerFlag.load(std::memory_order_relaxed) == Free)
+			lockBias.store(Biased, std::memory_order_release);
+		if (!ownerUpgrade.load(std::memory_order_relaxed))
+			upgradeBias.store(Biased, std::memory_order_release);
+	}
+};
+
+} // End alloc::
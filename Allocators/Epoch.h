@@ -0,0 +1,243 @@
+#pragma once
+#include <atomic>
+#include <array>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <cassert>
+#include <algorithm>
+#include "AllocHelpers.h"
+#include "ThreadRegistry.h"
+#include "BiasedMutex.h"
+
+namespace ImplEpoch
+{
+
+struct alignas(std::hardware_constructive_interference_size) Slot
+{
+	std::atomic<uint64_t>	epoch{ 0 };	// Epoch the thread entered in, 0 when it's outside
+	size_t					depth{ 0 };	// Nesting depth, only touched by the owning thread
+};
+
+struct Retired
+{
+	void*		ptr;
+	void		(*deleter)(void*);
+	uint64_t	epoch;
+};
+
+constexpr size_t chunkSlots = 64;
+constexpr size_t maxChunks	= 1024; // Enough for 65536 live threads
+
+using Chunk = std::array<Slot, chunkSlots>;
+
+} // End ImplEpoch::
+
+namespace alloc
+{
+
+// Process wide epoch based reclamation, for data that readers
+// walk without locks (see RcuPolicy in SmpContainer.h).
+//
+// Readers wrap their accesses in an Epoch::Guard, which only stores the
+// current epoch into the thread's own slot (no shared writes). Writers unlink
+// data and retire() it; it's freed once the global epoch has moved two past
+// the epoch it was retired in, which can only happen after every reader that
+// could have seen it has left.
+//
+// Readers get away with a compiler barrier, the writer
+// pays for both sides with BiasedMutex's process wide barrier
+class Epoch
+{
+	using Slot		= ImplEpoch::Slot;
+	using Retired	= ImplEpoch::Retired;
+	using Chunk		= ImplEpoch::Chunk;
+
+public:
+
+	// Guards nest, only the outermost one announces the thread
+	static void enter() noexcept
+	{
+		Slot& slot = mySlot();
+		if (slot.depth++)
+			return;
+
+		slot.epoch.store(state().global.load(std::memory_order_relaxed), std::memory_order_relaxed);
+		ImplBiasedMutex::lightBarrier();
+	}
+
+	static void exit() noexcept
+	{
+		Slot& slot = mySlot();
+		if (!--slot.depth)
+			slot.epoch.store(0, std::memory_order_release);
+	}
+
+	class Guard
+	{
+	public:
+		Guard() noexcept	{ enter(); }
+		~Guard()			{ exit(); }
+
+		Guard(const Guard&)				= delete;
+		Guard& operator=(const Guard&)	= delete;
+	};
+
+	// ptr must already be unreachable for new readers
+	template<class T>
+	static void retire(T* ptr)
+	{
+		retire(ptr, [](void* p) { delete static_cast<T*>(p); });
+	}
+
+	static void retire(void* ptr, void(*deleter)(void*))
+	{
+		auto& s = state();
+		{
+			// Order the caller's unlink before reading the epoch
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			std::lock_guard lock(s.mutex);
+			s.retired.emplace_back(Retired{ ptr, deleter, s.global.load(std::memory_order_relaxed) });
+		}
+		reclaim();
+	}
+
+	// Tries to move the epoch forward and frees whatever that made safe. Never waits
+	static void reclaim()
+	{
+		auto& s = state();
+		std::vector<Retired> freeable;
+		{
+			std::lock_guard lock(s.mutex);
+			tryAdvance(s);
+
+			const uint64_t global = s.global.load(std::memory_order_relaxed);
+			auto it = std::partition(std::begin(s.retired), std::end(s.retired), [&](const Retired& r)
+			{
+				return r.epoch + 2 > global;
+			});
+			freeable.assign(it, std::end(s.retired));
+			s.retired.erase(it, std::end(s.retired));
+		}
+
+		// Deleters run unlocked so they're free to retire things themselves
+		for (auto& r : freeable)
+			r.deleter(r.ptr);
+	}
+
+	// Waits until everything retired before the call has been freed.
+	// Must not be called from inside a Guard
+	static void synchronize()
+	{
+		auto& s				= state();
+		const uint64_t till = s.global.load(std::memory_order_acquire) + 2;
+
+		while (s.global.load(std::memory_order_acquire) < till)
+		{
+			bool advanced;
+			{
+				std::lock_guard lock(s.mutex);
+				advanced = tryAdvance(s);
+			}
+			if (!advanced)
+				std::this_thread::yield();
+		}
+		reclaim();
+	}
+
+	// Moves the epoch forward if every reader has caught up, without reclaiming
+	// anything. For callers that keep their own retire lists (EpochReclaimer)
+	static bool advance()
+	{
+		auto& s = state();
+		std::lock_guard lock(s.mutex);
+		return tryAdvance(s);
+	}
+
+	static uint64_t current() noexcept
+	{
+		return state().global.load(std::memory_order_relaxed);
+	}
+
+private:
+
+	struct State
+	{
+		std::atomic<uint64_t>							global{ 1 };
+		std::array<std::atomic<Chunk*>, ImplEpoch::maxChunks>	chunks{};
+		std::mutex										mutex;
+		std::vector<Retired>							retired;
+	};
+
+	// Never destroyed, threads and statics torn
+	// down after main can still be using it
+	static State& state()
+	{
+		static State* s = new State;
+		return *s;
+	}
+
+	// Found again if the thread's index changes (only while it's exiting)
+	static Slot& mySlot()
+	{
+		thread_local size_t idx		= ~size_t{ 0 };
+		thread_local Slot* slot		= nullptr;
+
+		const size_t now = ThreadRegistry::index();
+		if (now != idx)
+		{
+			slot	= &findSlot(now);
+			idx		= now;
+		}
+		return *slot;
+	}
+
+	static Slot& findSlot(size_t idx)
+	{
+		assert(idx / ImplEpoch::chunkSlots < ImplEpoch::maxChunks);
+
+		auto& chunk = state().chunks[idx / ImplEpoch::chunkSlots];
+		Chunk* c	= chunk.load(std::memory_order_acquire);
+		if (!c)
+		{
+			Chunk* fresh = new Chunk{};
+			if (chunk.compare_exchange_strong(c, fresh, std::memory_order_acq_rel))
+				c = fresh;
+			else
+				delete fresh;
+		}
+		return (*c)[idx % ImplEpoch::chunkSlots];
+	}
+
+	// The epoch can only move forward once every thread inside a Guard has seen it.
+	// s.mutex must be held
+	static bool tryAdvance(State& s)
+	{
+		// Makes any reader's slot store visible, or makes sure
+		// it will see everything we unlinked before this
+		ImplBiasedMutex::heavyBarrier();
+
+		const uint64_t global	= s.global.load(std::memory_order_acquire);
+		const size_t chunks		= std::min((ThreadRegistry::highWater() + ImplEpoch::chunkSlots - 1)
+			/ ImplEpoch::chunkSlots, ImplEpoch::maxChunks);
+
+		for (size_t i = 0; i < chunks; ++i)
+		{
+			Chunk* c = s.chunks[i].load(std::memory_order_acquire);
+			if (!c)
+				continue;
+
+			for (Slot& slot : *c)
+			{
+				const uint64_t e = slot.epoch.load(std::memory_order_acquire);
+				if (e && e != global)
+					return false;
+			}
+		}
+
+		s.global.store(global + 1, std::memory_order_release);
+		return true;
+	}
+};
+
+} // End alloc::
@@ -0,0 +1,260 @@
+#pragma once
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <algorithm>
+#include <functional>
+#include "Epoch.h"
+#include "SlabMulti.h"
+
+namespace ImplEpochReclaimer
+{
+
+// Shared between a reclaimer and the threads that use it, so a thread
+// exiting after the reclaimer is gone knows not to touch it
+struct Owner
+{
+	std::mutex	mutex;
+	bool		alive = true;
+};
+
+// Runs on thread exit for every reclaimer the thread used. Created after the
+// thread has its ThreadRegistry index, so it runs while the index is still ours
+struct ThreadExit
+{
+	struct Hook
+	{
+		std::weak_ptr<Owner>	owner;
+		std::function<void()>	func;
+	};
+
+	std::vector<Hook> hooks;
+
+	~ThreadExit()
+	{
+		for (auto& h : hooks)
+			if (auto owner = h.owner.lock())
+			{
+				std::lock_guard lock(owner->mutex);
+				if (owner->alive)
+					h.func();
+			}
+	}
+
+	static void add(std::weak_ptr<Owner> owner, std::function<void()> func)
+	{
+		thread_local ThreadExit exit;
+
+		// Drop hooks for reclaimers that have been destroyed
+		auto& hooks = exit.hooks;
+		hooks.erase(std::remove_if(std::begin(hooks), std::end(hooks), 
+			[](const Hook& h) { return h.owner.expired(); }), std::end(hooks));
+
+		hooks.emplace_back(Hook{ std::move(owner), std::move(func) });
+	}
+};
+
+} // End ImplEpochReclaimer::
+
+namespace alloc
+{
+
+// Node allocator for lock free structures whose readers use Epoch::Guard.
+// create() gives out nodes, retire() takes back ones that have been unlinked
+// but might still be read.
+//
+// Retired nodes go on a per thread list (no shared writes, no locks) tagged with
+// the epoch they were retired in. Every batch retires the thread tries to move the
+// global epoch and frees the part of its list no reader can see anymore. Freed
+// nodes are kept on the thread's free list for the next create() (type stable,
+// so they never leave this reclaimer), anything past freeCap goes back to Al.
+// When a thread exits its free list goes back to Al and whatever it still has
+// retired is handed to the other threads to reclaim
+template<class T, class Al = alloc::SlabMulti<T>, size_t batch = 64, size_t freeCap = 256>
+class EpochReclaimer
+{
+	using Traits = std::allocator_traits<Al>;
+
+	struct Retired
+	{
+		T*			node;
+		uint64_t	epoch;
+	};
+
+	struct Local
+	{
+		std::vector<Retired>	retired;
+		std::vector<T*>			free;
+		bool					watched = false;	// The thread using this index will hand it back on exit
+	};
+
+	// Keyed by ThreadRegistry index, only ever touched by the thread with that index
+	using Locals = alloc::SmpMap<size_t, Local, alloc::RcuPolicy>;
+	using Owner	 = ImplEpochReclaimer::Owner;
+
+	Locals					locals;
+	Al						al;
+	std::shared_ptr<Owner>	owner;		// owner->mutex guards orphans
+	std::vector<Retired>	orphans;	// Retired by threads that have exited
+	std::atomic<bool>		hasOrphans;
+
+	Local& local()
+	{
+		const auto id	= alloc::ThreadRegistry::index();
+		Local* l		= locals.findDo(id, [](auto it, auto& cont) -> Local*
+		{
+			return it != std::end(cont) ? &it->second : nullptr;
+		});
+		if (!l)
+			l = &locals.emplace(id);
+
+		if (!l->watched)
+			watch(*l);
+		return *l;
+	}
+
+	// Threads that exit might never have their index (and Local) reused,
+	// so when they go their lists are emptied (under owner->mutex)
+	void watch(Local& l)
+	{
+		l.watched = true;
+		ImplEpochReclaimer::ThreadExit::add(owner, [this, &l]()
+		{
+			for (T* node : l.free)
+				Traits::deallocate(al, node, 1);
+			l.free.clear();
+
+			if (!l.retired.empty())
+			{
+				orphans.insert(std::end(orphans), std::begin(l.retired), std::end(l.retired));
+				l.retired.clear();
+				hasOrphans.store(true, std::memory_order_release);
+			}
+			l.watched = false;
+		});
+	}
+
+	// Retired nodes whose thread exited don't wait for it to
+	// come back, whoever reclaims next frees them
+	void reclaimOrphans(Local& l, uint64_t global)
+	{
+		std::lock_guard lock(owner->mutex);
+
+		auto safe = std::partition(std::begin(orphans), std::end(orphans), 
+			[&](const Retired& r) { return r.epoch + 2 > global; });
+
+		for (auto it = safe; it != std::end(orphans); ++it)
+		{
+			Traits::destroy(al, it->node);
+			if (l.free.size() < freeCap)
+				l.free.emplace_back(it->node);
+			else
+				Traits::deallocate(al, it->node, 1);
+		}
+		orphans.erase(safe, std::end(orphans));
+		hasOrphans.store(!orphans.empty(), std::memory_order_relaxed);
+	}
+
+	// Retired lists are in epoch order, so everything
+	// that's safe to free is at the front
+	void reclaim(Local& l)
+	{
+		const uint64_t global = alloc::Epoch::current();
+
+		auto it = std::begin(l.retired);
+		for (; it != std::end(l.retired) && it->epoch + 2 <= global; ++it)
+		{
+			Traits::destroy(al, it->node);
+			if (l.free.size() < freeCap)
+				l.free.emplace_back(it->node);
+			else
+				Traits::deallocate(al, it->node, 1);
+		}
+		l.retired.erase(std::begin(l.retired), it);
+
+		if (hasOrphans.load(std::memory_order_acquire))
+			reclaimOrphans(l, global);
+	}
+
+public:
+
+	explicit EpochReclaimer(const Al& al = Al{}) :
+		locals{						},
+		al{			al					},
+		owner{		std::make_shared<Owner>() },
+		orphans{					},
+		hasOrphans{ false				}
+	{}
+
+	// Nothing can be reading the nodes anymore. Threads that exit
+	// from here on leave us alone
+	~EpochReclaimer()
+	{
+		std::lock_guard lock(owner->mutex);
+		owner->alive = false;
+
+		for (auto& r : orphans)
+		{
+			Traits::destroy(al, r.node);
+			Traits::deallocate(al, r.node, 1);
+		}
+
+		locals.iterate([&](auto& pair) -> bool
+		{
+			for (auto& r : pair.second.retired)
+			{
+				Traits::destroy(al, r.node);
+				Traits::deallocate(al, r.node, 1);
+			}
+			for (T* node : pair.second.free)
+				Traits::deallocate(al, node, 1);
+			return false;
+		});
+	}
+
+	EpochReclaimer(const EpochReclaimer& other)				= delete;
+	EpochReclaimer& operator=(const EpochReclaimer& other)	= delete;
+
+	template<class... Args>
+	T* create(Args&& ...args)
+	{
+		Local& l = local();
+
+		T* node;
+		if (l.free.empty())
+			node = Traits::allocate(al, 1);
+		else
+		{
+			node = l.free.back();
+			l.free.pop_back();
+		}
+
+		Traits::construct(al, node, std::forward<Args>(args)...);
+		return node;
+	}
+
+	// node must already be unreachable for new readers
+	void retire(T* node)
+	{
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+
+		Local& l = local();
+		l.retired.emplace_back(Retired{ node, alloc::Epoch::current() });
+
+		if (l.retired.size() % batch == 0)
+		{
+			alloc::Epoch::advance();
+			reclaim(l);
+		}
+	}
+
+	// Frees whatever this thread has retired that's safe to free now
+	void flush()
+	{
+		Local& l = local();
+		alloc::Epoch::advance();
+		reclaim(l);
+	}
+};
+
+} // End alloc::
@@ -1,275 +1,841 @@
 #pragma once
-#include <map>
-#include <list>
-#include <vector>
+#include <new>
+#include <limits>
 #include <algorithm>
+#include <cstring>
 #include "AllocHelpers.h"
 
 namespace FreeListImpl
 {
+using byte = alloc::byte;
+
 enum AlSearch : byte
 {
 	BEST_FIT,
 	FIRST_FIT
 };
 
-template<size_t bytes, class size_type,
-	class Interface, class Storage>
-	struct PolicyT
+template<size_t bytes,
+	template<size_t, class, class> class Policy>
+struct PolicyInterface
 {
-	//using Storage	= std::vector<std::pair<byte*, size_type>>;
-	using It = typename Storage::iterator;
-	using Ib = std::pair<It, bool>;
-	using Header = typename Interface::Header;
+	// Detect the minimum size type we can use
+	// (based on max number of bytes) and use that as the
+	// size_type to keep overhead as low as possible
+	using size_type = typename alloc::FindSizeT<bytes, 0>::size_type;
+
+	// Every block starts with a Header. Free blocks also end with a
+	// copy of their size (the footer) so the block after them can find
+	// where they start, used blocks don't need one since PREV_FREE says
+	// whether it's there.
+	struct Header
+	{
+		enum : size_type
+		{
+			FREE		= 1,
+			PREV_FREE	= 2,
+			FLAGS		= FREE | PREV_FREE
+		};
+
+		size_type tag; // Size of the block (header included) | flags
+
+		size_type size()	const noexcept { return static_cast<size_type>(tag & ~FLAGS); }
+		bool free()			const noexcept { return tag & FREE; }
+		bool prevFree()		const noexcept { return tag & PREV_FREE; }
+	};
+
+	using OurType		= PolicyInterface<bytes, Policy>;
+	using OurPolicy		= Policy<bytes, size_type, OurType>;
+
+	// Block sizes are kept a multiple of this so the
+	// low bits of every size are free for the flags
+	static constexpr size_t granularity	= std::max<size_t>(sizeof(size_type), 4);
+	static constexpr size_t headerSize	= sizeof(Header);
+	static constexpr size_t footerSize	= sizeof(size_type);
+	static constexpr size_t arenaBytes	= bytes & ~(granularity - 1);
 
-	inline static Storage availible;
+	// A free block must be able to hold its header, footer and the policy's node
+	static constexpr size_t minBlock	= (headerSize + OurPolicy::nodeBytes + footerSize
+		+ granularity - 1) & ~(granularity - 1);
 
-	template<class K, class V, class ...Args>
-	It emplace(std::vector<std::pair<K, V>>& v, It it, Args&& ...args)
+	static_assert(arenaBytes >= minBlock, "Allocator size is smaller than minimum required.");
+
+	// Handles how we store and find free blocks
+	OurPolicy	policy;
+
+	byte*		MyBegin;
+	byte*		MyEnd;
+
+	AlSearch	search		= FIRST_FIT;
+	size_type	bytesFree	= arenaBytes;
+	size_t		refCount	= 1; // FreeLists sharing this arena
+
+	// Each one owns its own arena, nothing is shared between them
+	PolicyInterface() :
+		MyBegin{	reinterpret_cast<byte*>(operator new (bytes))	},
+		MyEnd{		MyBegin + arenaBytes							}
 	{
-		return v.emplace(it, std::forward<Args>(args)...);
+		freeAll();
 	}
 
-	template<class K, class V, class ...Args>
-	It emplace(std::list<std::pair<K, V>>& l, It it, Args&& ...args)
+	~PolicyInterface()
 	{
-		return l.emplace(it, std::forward<Args>(args)...);
+		operator delete (MyBegin);
 	}
 
-	template<class K, class V, class ...Args>
-	It emplace(std::map<K, V>& m, It it, Args&& ...args)
+	PolicyInterface(const PolicyInterface&)				= delete;
+	PolicyInterface& operator=(const PolicyInterface&)	= delete;
+
+	static Header& header(byte* block) noexcept
 	{
-		return m.emplace(std::forward<Args>(args)...).first;
+		return *reinterpret_cast<Header*>(block);
 	}
 
-	// Lower bound impl for linear containers (vec/list)
-	template<class C, class P>
-	It lower_bound_linear(C& c, P* ptr)
+	static size_type sizeOf(byte* block) noexcept
 	{
-		return std::lower_bound(
-			std::begin(c), std::end(c),
-			ptr, [](auto& it1, auto& it2)
-		{
-			return it1.first < it2;
-		});
+		return header(block).size();
 	}
 
-	template<class K, class V, class P>
-	It lower_bound(std::vector<std::pair<K, V>>& v, P* ptr)
+	// Size of the block needed to hand out userBytes. Stays a size_t, near
+	// the top of the arena rounding up can overflow size_type
+	static constexpr size_t blockBytes(size_t userBytes) noexcept
 	{
-		return lower_bound_linear(v, ptr);
+		const size_t b = (userBytes + headerSize + granularity - 1) & ~(granularity - 1);
+		return std::max(b, minBlock);
 	}
 
-	template<class K, class V, class P>
-	It lower_bound(std::list<std::pair<K, V>>& l, P* ptr)
+	// Writes the boundary tags of a free block, tells the block after it,
+	// and hands it to the policy. The block before it must be in use
+	void makeFree(byte* block, size_type size)
 	{
-		return lower_bound_linear(l, ptr);
+		header(block).tag = static_cast<size_type>(size | Header::FREE);
+		*reinterpret_cast<size_type*>(block + size - footerSize) = size;
+
+		if (block + size < MyEnd)
+			header(block + size).tag = static_cast<size_type>(header(block + size).tag | Header::PREV_FREE);
+
+		policy.insert(block);
 	}
 
-	template<class K, class V, class P>
-	It lower_bound(std::map<K, V>& m, P* ptr)
+	// Marks a block in use. The block before it must be in use
+	void makeUsed(byte* block, size_type size)
 	{
-		return m.lower_bound(ptr);
+		header(block).tag = size;
+		if (block + size < MyEnd)
+			header(block + size).tag = static_cast<size_type>(header(block + size).tag & ~Header::PREV_FREE);
 	}
 
-	void add(byte* start, size_type size)
+	// Takes size bytes from the front of the free block,
+	// anything left that's large enough to use is freed again
+	byte* carve(byte* block, size_type size)
 	{
-		if (availible.empty())
+		const size_type chunkBytes = sizeOf(block);
+		policy.erase(block);
+
+		if (static_cast<size_t>(chunkBytes - size) >= minBlock)
 		{
-			emplace(availible, std::end(availible), start, size);
-			return;
+			header(block).tag = size;
+			makeFree(block + size, chunkBytes - size);
 		}
+		else
+			makeUsed(block, size = chunkBytes);
+
+		bytesFree -= size;
+		return block + headerSize;
+	}
 
-		auto it = lower_bound(availible, start);
+	byte* bestFit(size_type reqBytes)
+	{
+		byte* block = policy.bestFit(reqBytes);
+		if (!block)
+			return nullptr;
 
-		if (it == std::end(availible) || it->first > start)
-			it = emplace(availible, it, start, size + Interface::headerSize);
+		return carve(block, reqBytes);
+	}
 
-		// Perform coalescence of adjacent blocks
-		It next = it, prev = it;
-		++next;
+	byte* firstFit(size_type reqBytes)
+	{
+		byte* block = policy.firstFit(reqBytes);
+		if (!block)
+			return nullptr;
 
-		if (next != std::end(availible) &&
-			it->first + it->second == next->first)
+		return carve(block, reqBytes);
+	}
+
+	template<class T>
+	T* allocate(size_type count)
+	{
+		byte* mem = nullptr;
+		if (sizeof(T) * count > arenaBytes)
+			throw std::bad_alloc();
+
+		const size_t reqBytes = blockBytes(sizeof(T) * count);
+		if (reqBytes > arenaBytes)
+			throw std::bad_alloc();
+
+		if (search == FIRST_FIT)
+			mem = firstFit(static_cast<size_type>(reqBytes));
+		else
+			mem = bestFit(static_cast<size_type>(reqBytes));
+
+		if (!mem)
+			throw std::bad_alloc();
+
+		return reinterpret_cast<T*>(mem);
+	}
+
+	// Coalescing only needs the boundary tags of the neighbours,
+	// there's no searching for them
+	template<class T>
+	void deallocate(T* ptr)
+	{
+		byte* block		= reinterpret_cast<byte*>(ptr) - headerSize;
+		size_type size	= sizeOf(block);
+		bytesFree		+= size;
+
+		byte* next = block + size;
+		if (next < MyEnd && header(next).free())
 		{
-			it->second += next->second;
-			availible.erase(next);
+			policy.erase(next);
+			size += sizeOf(next);
 		}
-		if (prev != std::begin(availible) &&
-			(--prev)->first + prev->second == it->first)
+
+		if (header(block).prevFree())
 		{
-			prev->second += it->second;
-			availible.erase(it);
+			const size_type prevSize = *reinterpret_cast<size_type*>(block - footerSize);
+			block -= prevSize;
+			policy.erase(block);
+			size += prevSize;
 		}
+
+		makeFree(block, size);
 	}
 
-	Ib firstFit(size_t reqBytes)
+	// Resize the allocation at ptr to newBytes without moving it.
+	// Growing only works if the block directly after ptr is free
+	// and large enough, shrinking always works
+	bool try_expand(byte* ptr, size_t newBytes)
 	{
-		for (auto it = std::begin(availible), 
-			E = std::end(availible);
-			it != E; ++it)
+		if (newBytes > arenaBytes || blockBytes(newBytes) > arenaBytes)
+			return false;
+
+		byte* block					= ptr - headerSize;
+		const size_type oldSize		= sizeOf(block);
+		const size_type newSize		= static_cast<size_type>(blockBytes(newBytes));
+		byte* next					= block + oldSize;
+
+		if (newSize <= oldSize)
 		{
-			// Found a section of memory large enough to hold
-			// what we want to allocate
-			if (it->second >= reqBytes)
-				return { it, true };
+			// Only give the tail back if something could be allocated from it
+			size_type tail = oldSize - newSize;
+			if (tail < minBlock)
+				return true;
+
+			header(block).tag	= static_cast<size_type>(newSize | (header(block).tag & Header::PREV_FREE));
+			bytesFree			+= tail;
+
+			if (next < MyEnd && header(next).free())
+			{
+				policy.erase(next);
+				tail += sizeOf(next);
+			}
+			makeFree(block + newSize, tail);
+			return true;
 		}
-		return { It{}, false };
+
+		if (next >= MyEnd || !header(next).free() || oldSize + sizeOf(next) < newSize)
+			return false;
+
+		const size_type total		= oldSize + sizeOf(next);
+		const size_type prevFlag	= static_cast<size_type>(header(block).tag & Header::PREV_FREE);
+		policy.erase(next);
+
+		// Absorb what's left of the free block if it's
+		// too small to ever be allocated from
+		size_type size = newSize;
+		if (static_cast<size_t>(total - newSize) >= minBlock)
+		{
+			header(block).tag = newSize;
+			makeFree(block + newSize, total - newSize);
+		}
+		else
+			makeUsed(block, size = total);
+
+		header(block).tag	= static_cast<size_type>(header(block).tag | prevFlag);
+		bytesFree			-= size - oldSize;
+		return true;
 	}
 
-	void erase(It it)
+	void freeAll()
 	{
-		availible.erase(it);
+		policy.init(MyBegin, MyEnd);
+		makeFree(MyBegin, static_cast<size_type>(arenaBytes));
+		bytesFree = arenaBytes;
 	}
 
-	void freeAll(byte* MyBegin)
+	// Walks every block in address order, used and free
+	template<class Func>
+	void forEachBlock(Func&& func) const
 	{
-		availible.clear();
-		emplace(availible, std::end(availible), MyBegin, bytes);
+		for (byte* block = MyBegin; block < MyEnd; block += sizeOf(block))
+			func(block, header(block));
+	}
+
+	size_t freeBlocks() const
+	{
+		size_t count = 0;
+		forEachBlock([&](byte*, const Header& h) { count += h.free(); });
+		return count;
+	}
+
+	size_type largestFree() const
+	{
+		size_type largest = 0;
+		forEachBlock([&](byte*, const Header& h)
+		{
+			if (h.free())
+				largest = std::max(largest, h.size());
+		});
+		return largest;
 	}
 };
 
-template<size_t bytes,
-	template<size_t, class, class> class Policy>
-struct PolicyInterface
+// Free blocks are linked through offsets from the start of the
+// arena instead of pointers, so nodes are only as wide as size_type.
+// Offsets are always a multiple of the granularity so npos is never one
+template<class size_type>
+struct Offsets
 {
-	// Detect the minimum size type we can use
-	// (based on max number of bytes) and use that as the
-	// size_type to keep overhead as low as possible
-	using size_type = typename alloc::FindSizeT<bytes, 0>::size_type;
+	static constexpr size_type npos = std::numeric_limits<size_type>::max();
 
-	struct Header
+	byte* base = nullptr;
+
+	size_type	offset(byte* block)	const noexcept { return block ? static_cast<size_type>(block - base) : npos; }
+	byte*		block(size_type off)	const noexcept { return off == npos ? nullptr : base + off; }
+};
+
+} // End FreeListImpl::
+
+namespace alloc
+{
+
+// Policies store their nodes inside the free blocks themselves (just
+// after the header) so the FreeList never touches the system allocator
+// after it's built. Each provides:
+//
+// nodeBytes				- Bytes its node needs inside a free block
+// init(begin, end)			- Forget every block, the arena is about to be reset
+// insert(block)			- Track a free block (header and footer already written)
+// erase(block)				- Stop tracking a free block
+// firstFit(size)			- A free block of at least size bytes, or nullptr
+// bestFit(size)			- The smallest free block of at least size bytes, or nullptr
+//
+// Coalescing is handled by the interface through the boundary tags, so
+// policies never have to find a block's neighbours.
+
+// No free list at all, firstFit walks every block (used or free)
+// in address order through the headers. Smallest blocks, slowest search.
+// The walk starts at lowest, which no free block is ever below
+template<size_t bytes, class size_type,
+	class Interface>
+struct FlatPolicy
+{
+	static constexpr size_t nodeBytes = 0;
+
+	byte* lowest	= nullptr;
+	byte* end		= nullptr;
+
+	void init(byte* b, byte* e)
+	{
+		lowest	= b;
+		end		= e;
+	}
+
+	void insert(byte* block)
+	{
+		lowest = std::min(lowest, block);
+	}
+
+	// The block's header is still intact so we can step over it
+	void erase(byte* block)
+	{
+		if (block == lowest)
+			lowest += Interface::sizeOf(block);
+	}
+
+	byte* firstFit(size_type size)
+	{
+		bool seenFree = false;
+		for (byte* block = lowest; block < end; block += Interface::sizeOf(block))
+		{
+			auto& h = Interface::header(block);
+			if (!h.free())
+				continue;
+
+			if (!seenFree)
+			{
+				seenFree	= true;
+				lowest		= block;
+			}
+			if (h.size() >= size)
+				return block;
+		}
+
+		if (!seenFree)
+			lowest = end;
+		return nullptr;
+	}
+
+	byte* bestFit(size_type size)
+	{
+		byte* best = nullptr;
+		for (byte* block = lowest; block < end; block += Interface::sizeOf(block))
+		{
+			auto& h = Interface::header(block);
+			if (!h.free() || h.size() < size || (best && h.size() >= Interface::sizeOf(best)))
+				continue;
+
+			best = block;
+			if (h.size() == size)
+				break;
+		}
+		return best;
+	}
+};
+
+// Intrusive doubly linked list of free blocks. Freed
+// blocks go on the front, firstFit walks only free blocks
+template<size_t bytes, class size_type,
+	class Interface>
+struct ListPolicy
+{
+	struct Node
 	{
-		size_type size;
-		//size_type size : (sizeof(size_type) * 8) - 1;
-		//size_type free : 1;
+		size_type prev;
+		size_type next;
 	};
 
-	using OurType		= PolicyInterface<bytes, Policy>;
-	using OurPolicy		= Policy<bytes, size_type, OurType>;
-	using It			= typename OurPolicy::It;
-	using Ib			= typename OurPolicy::Ib;
+	static constexpr size_t nodeBytes = sizeof(Node);
 
-	// Handles how we store, find, 
-	// and emplace free memory information
-	inline static OurPolicy policy;
+	using Offsets = FreeListImpl::Offsets<size_type>;
 
-	inline static byte* MyBegin;
-	inline static byte* MyEnd;
+	Offsets		off;
+	size_type	head = Offsets::npos;
 
-	inline static bool init						= true;
-	inline static AlSearch search				= FIRST_FIT; // TODO: Get rid of?
-	inline static size_type bytesFree			= bytes;
-	inline static constexpr size_t headerSize	= sizeof(Header);
+	Node& node(byte* block) const noexcept
+	{
+		return *reinterpret_cast<Node*>(block + Interface::headerSize);
+	}
 
-	static_assert(bytes > headerSize + 1, "Allocator size is smaller than minimum required.");
+	void init(byte* b, byte*)
+	{
+		off.base	= b;
+		head		= Offsets::npos;
+	}
 
-	PolicyInterface()
+	void insert(byte* block)
 	{
-		if (init)
+		Node& n = node(block);
+		n.prev	= Offsets::npos;
+		n.next	= head;
+
+		if (head != Offsets::npos)
+			node(off.block(head)).prev = off.offset(block);
+		head = off.offset(block);
+	}
+
+	void erase(byte* block)
+	{
+		Node& n = node(block);
+		if (n.prev != Offsets::npos)
+			node(off.block(n.prev)).next = n.next;
+		else
+			head = n.next;
+
+		if (n.next != Offsets::npos)
+			node(off.block(n.next)).prev = n.prev;
+	}
+
+	byte* firstFit(size_type size)
+	{
+		for (byte* block = off.block(head); block; block = off.block(node(block).next))
+			if (Interface::sizeOf(block) >= size)
+				return block;
+		return nullptr;
+	}
+
+	byte* bestFit(size_type size)
+	{
+		byte* best = nullptr;
+		for (byte* block = off.block(head); block; block = off.block(node(block).next))
 		{
-			// TODO: Should we just make this class use an  
-			// array since it's size is compile time determined?
-			init	= false;
-			MyBegin	= reinterpret_cast<byte*>(operator new (bytes));
-			MyEnd	= MyBegin + bytes;
-			policy.add(MyBegin, bytes);
+			const size_type bSize = Interface::sizeOf(block);
+			if (bSize < size || (best && bSize >= Interface::sizeOf(best)))
+				continue;
+
+			best = block;
+			if (bSize == size)
+				break;
 		}
+		return best;
 	}
+};
 
-	byte* bestFit(const size_t byteCount)
+// Intrusive treaps of free blocks, every block is in two: one ordered by
+// address and one by size. The address tree also keeps the largest block
+// in each subtree, so firstFit finds the lowest addressed block that fits
+// and bestFit the smallest, both in O(log n)
+template<size_t bytes, class size_type,
+	class Interface>
+struct TreePolicy
+{
+	struct Node
 	{
-		return nullptr;
+		size_type left;
+		size_type right;
+		size_type largest; // Largest block in this subtree of the address tree
+		size_type sLeft;
+		size_type sRight;
+	};
+
+	static constexpr size_t nodeBytes = sizeof(Node);
+
+	using Offsets	= FreeListImpl::Offsets<size_type>;
+	using OurType	= TreePolicy<bytes, size_type, Interface>;
+
+	Offsets		off;
+	size_type	byAddr = Offsets::npos;
+	size_type	bySize = Offsets::npos;
+
+	Node& node(size_type o) const noexcept
+	{
+		return *reinterpret_cast<Node*>(off.block(o) + Interface::headerSize);
 	}
 
-	byte* firstFit(size_type reqBytes)
+	size_type sizeOf(size_type o) const noexcept
 	{
-		auto[it, found] = policy.firstFit(reqBytes);
-		if (!found)
-			return nullptr;
+		return Interface::sizeOf(off.block(o));
+	}
+
+	size_type largest(size_type o) const noexcept
+	{
+		return o == Offsets::npos ? 0 : node(o).largest;
+	}
 
-		auto* mem = it->first;
-		auto chunkBytes = std::move(it->second);
-		policy.erase(it);
+	struct AddrOrder
+	{
+		static constexpr size_type Node::*left	= &Node::left;
+		static constexpr size_type Node::*right	= &Node::right;
+
+		static bool before(const OurType&, size_type a, size_type b) noexcept
+		{
+			return a < b;
+		}
 
-		// If memory section is larger than what we want
-		// add a new list entry that reflects the remaining memory
-		if (chunkBytes > reqBytes)
-			policy.add(mem + reqBytes, chunkBytes - reqBytes);
+		static void update(OurType& p, size_type o) noexcept
+		{
+			Node& n		= p.node(o);
+			n.largest	= std::max({ p.sizeOf(o), p.largest(n.left), p.largest(n.right) });
+		}
+	};
 
-		return writeHeader(mem, reqBytes - headerSize);
+	// Address breaks ties so every key is unique
+	struct SizeOrder
+	{
+		static constexpr size_type Node::*left	= &Node::sLeft;
+		static constexpr size_type Node::*right	= &Node::sRight;
+
+		static bool before(const OurType& p, size_type a, size_type b) noexcept
+		{
+			return std::pair(p.sizeOf(a), a) < std::pair(p.sizeOf(b), b);
+		}
+
+		static void update(OurType&, size_type) noexcept {}
+	};
+
+	// Priorities come from a hash of the address, so the
+	// trees stay balanced without storing anything extra
+	static uint32_t priority(size_type o) noexcept
+	{
+		uint64_t h = (static_cast<uint64_t>(o) + 1) * 11400714819323198485ull;
+		h ^= h >> 29;
+		return static_cast<uint32_t>((h * 11400714819323198485ull) >> 32);
 	}
 
-	// Writes the header and adjusts the returned 
-	// pointer to user memory
-	byte* writeHeader(byte* start, size_type size)
+	// Splits t into the nodes before and after key
+	template<class Order>
+	std::pair<size_type, size_type> split(size_type t, size_type key)
 	{
-		*reinterpret_cast<Header*>(start) = Header{ size };
-		return start + headerSize;
+		if (t == Offsets::npos)
+			return { Offsets::npos, Offsets::npos };
+
+		Node& n = node(t);
+		if (Order::before(*this, t, key))
+		{
+			auto [l, r]			= split<Order>(n.*Order::right, key);
+			n.*Order::right		= l;
+			Order::update(*this, t);
+			return { t, r };
+		}
+
+		auto [l, r]			= split<Order>(n.*Order::left, key);
+		n.*Order::left		= r;
+		Order::update(*this, t);
+		return { l, t };
 	}
 
-	template<class T>
-	T* allocate(size_type count)
+	// Every node in a must be before every node in b
+	template<class Order>
+	size_type merge(size_type a, size_type b)
 	{
-		byte* mem = nullptr;
-		size_type reqBytes = sizeof(T) * count + headerSize;
+		if (a == Offsets::npos)
+			return b;
+		if (b == Offsets::npos)
+			return a;
 
-		if (search == FIRST_FIT)
-			mem = firstFit(reqBytes);
+		if (priority(a) > priority(b))
+		{
+			node(a).*Order::right = merge<Order>(node(a).*Order::right, b);
+			Order::update(*this, a);
+			return a;
+		}
+
+		node(b).*Order::left = merge<Order>(a, node(b).*Order::left);
+		Order::update(*this, b);
+		return b;
+	}
+
+	template<class Order>
+	size_type insert(size_type t, size_type o)
+	{
+		if (t == Offsets::npos || priority(o) > priority(t))
+		{
+			auto [l, r]			= split<Order>(t, o);
+			Node& n				= node(o);
+			n.*Order::left		= l;
+			n.*Order::right		= r;
+			Order::update(*this, o);
+			return o;
+		}
+
+		Node& n = node(t);
+		if (Order::before(*this, o, t))
+			n.*Order::left	= insert<Order>(n.*Order::left, o);
 		else
-			mem = bestFit(reqBytes);
+			n.*Order::right	= insert<Order>(n.*Order::right, o);
 
-		if (!mem)
-			throw std::bad_alloc();
+		Order::update(*this, t);
+		return t;
+	}
 
-		bytesFree -= reqBytes;
-		return reinterpret_cast<T*>(mem);
+	template<class Order>
+	size_type erase(size_type t, size_type o)
+	{
+		Node& n = node(t);
+		if (t == o)
+			return merge<Order>(n.*Order::left, n.*Order::right);
+
+		if (Order::before(*this, o, t))
+			n.*Order::left	= erase<Order>(n.*Order::left, o);
+		else
+			n.*Order::right	= erase<Order>(n.*Order::right, o);
+
+		Order::update(*this, t);
+		return t;
 	}
 
-	template<class T>
-	void deallocate(T* ptr)
+	void init(byte* b, byte*)
 	{
-		Header* header	= reinterpret_cast<Header*>(reinterpret_cast<byte*>(ptr) - headerSize);
-		bytesFree		+= header->size + headerSize;
+		off.base	= b;
+		byAddr		= Offsets::npos;
+		bySize		= Offsets::npos;
+	}
 
-		policy.add(reinterpret_cast<byte*>(header), header->size);
+	void insert(byte* block)
+	{
+		byAddr = insert<AddrOrder>(byAddr, off.offset(block));
+		bySize = insert<SizeOrder>(bySize, off.offset(block));
 	}
 
-	void freeAll()
+	void erase(byte* block)
 	{
-		policy.freeAll(MyBegin);
-		bytesFree = bytes;
+		byAddr = erase<AddrOrder>(byAddr, off.offset(block));
+		bySize = erase<SizeOrder>(bySize, off.offset(block));
+	}
+
+	byte* firstFit(size_type size)
+	{
+		if (largest(byAddr) < size)
+			return nullptr;
+
+		for (size_type t = byAddr;;)
+		{
+			const Node& n = node(t);
+			if (largest(n.left) >= size)
+				t = n.left;
+			else if (sizeOf(t) >= size)
+				return off.block(t);
+			else
+				t = n.right;
+		}
+	}
+
+	// Smallest block that fits, the lowest addressed one on ties
+	byte* bestFit(size_type size)
+	{
+		size_type best = Offsets::npos;
+		for (size_type t = bySize; t != Offsets::npos;)
+		{
+			const Node& n = node(t);
+			if (sizeOf(t) >= size)
+			{
+				best	= t;
+				t		= n.sLeft;
+			}
+			else
+				t = n.sRight;
+		}
+		return off.block(best);
 	}
 };
-}
 
-namespace alloc
-{
-// TODO: For all three policies, integrate the nodes
-// storing info about the free memory blocks into the blocks
-// themselves. Removing the need to the std::containers
+// Two level segregated fit. Free blocks sit in intrusive lists split by
+// size: the first level is the power of 2 at or below the size, the second
+// splits that range linearly into slCount lists. A bitmap per level tracks
+// which lists have blocks, so insert, erase and firstFit are all O(1).
 //
-
-// Store the 'list' of free nods in std::vector
+// firstFit rounds the request up to the next list, so any block found fits without
+// walking the list (a good fit, at most 1 / slCount larger than needed). The catch is
+// a block that would fit but shares the request's list isn't found
 template<size_t bytes, class size_type,
 	class Interface>
-	struct FlatPolicy 
-	: public FreeListImpl::PolicyT<bytes, size_type, Interface, 
-		std::vector<std::pair<byte*, size_type>>>
-{};
+struct TlsfPolicy
+{
+	struct Node
+	{
+		size_type prev;
+		size_type next;
+	};
 
-// Store the 'list' of free nods in std::map
-template<size_t bytes, class size_type,
-	class Interface> 
-	struct TreePolicy : public FreeListImpl::PolicyT<bytes, size_type, Interface,
-	std::map<byte*, size_type>>
-{};
+	static constexpr size_t nodeBytes	= sizeof(Node);
+	static constexpr int slLog2			= 4;
+	static constexpr int slCount		= 1 << slLog2;
+	static constexpr int flCount		= sizeof(size_type) * 8 - slLog2 + 1;
 
-template<size_t bytes, class size_type,
-	class Interface>
-	struct ListPolicy : public FreeListImpl::PolicyT<bytes, size_type, Interface,
-	std::list<std::pair<byte*, size_type>>>
-{};
+	using Offsets = FreeListImpl::Offsets<size_type>;
+
+	Offsets		off;
+	uint64_t	flMap					= 0;
+	uint32_t	slMap[flCount]			= {};
+	size_type	heads[flCount][slCount]	= {};
+
+	Node& node(byte* block) const noexcept
+	{
+		return *reinterpret_cast<Node*>(block + Interface::headerSize);
+	}
+
+	// Sizes below slCount all go in the first level, one list each
+	static std::pair<int, int> mapping(size_t size) noexcept
+	{
+		if (size < slCount)
+			return { 0, static_cast<int>(size) };
+
+		const int high = alloc::highestSetBit(size);
+		return { high - slLog2 + 1, static_cast<int>(size >> (high - slLog2)) - slCount };
+	}
+
+	void init(byte* b, byte*)
+	{
+		off.base	= b;
+		flMap		= 0;
+		std::fill(std::begin(slMap), std::end(slMap), 0);
+		std::fill(&heads[0][0], &heads[0][0] + flCount * slCount, Offsets::npos);
+	}
+
+	void insert(byte* block)
+	{
+		const auto [fl, sl] = mapping(Interface::sizeOf(block));
+		size_type& head		= heads[fl][sl];
+
+		Node& n = node(block);
+		n.prev	= Offsets::npos;
+		n.next	= head;
+
+		if (head != Offsets::npos)
+			node(off.block(head)).prev = off.offset(block);
+		head = off.offset(block);
+
+		flMap		|= uint64_t{ 1 } << fl;
+		slMap[fl]	|= 1u << sl;
+	}
+
+	void erase(byte* block)
+	{
+		const auto [fl, sl] = mapping(Interface::sizeOf(block));
+		Node& n				= node(block);
+
+		if (n.prev != Offsets::npos)
+			node(off.block(n.prev)).next = n.next;
+		else
+			heads[fl][sl] = n.next;
+
+		if (n.next != Offsets::npos)
+			node(off.block(n.next)).prev = n.prev;
+
+		if (heads[fl][sl] == Offsets::npos)
+		{
+			slMap[fl] &= ~(1u << sl);
+			if (!slMap[fl])
+				flMap &= ~(uint64_t{ 1 } << fl);
+		}
+	}
+
+	byte* firstFit(size_type size)
+	{
+		size_t rounded = size;
+		if (rounded >= slCount)
+			rounded += (size_t{ 1 } << (alloc::highestSetBit(rounded) - slLog2)) - 1;
+
+		auto [fl, sl] = mapping(rounded);
+		if (fl >= flCount)
+			return nullptr;
+
+		// Anything left in this level, otherwise the smallest list of the next used level
+		uint64_t sls = slMap[fl] & (~0u << sl);
+		if (!sls)
+		{
+			const uint64_t fls = flMap & (~uint64_t{ 0 } << (fl + 1));
+			if (!fls)
+				return nullptr;
+
+			fl	= alloc::lowestSetBit(fls);
+			sls	= slMap[fl];
+		}
+
+		return off.block(heads[fl][alloc::lowestSetBit(sls)]);
+	}
+
+	// Also checks the list the request itself maps to, which firstFit skips.
+	// Walking it is the only part that isn't O(1), and past that list
+	// it's still only a good fit
+	byte* bestFit(size_type size)
+	{
+		const auto [fl, sl]	= mapping(size);
+		byte* best			= nullptr;
+
+		for (byte* block = off.block(heads[fl][sl]); block; block = off.block(node(block).next))
+		{
+			const size_type bSize = Interface::sizeOf(block);
+			if (bSize < size || (best && bSize >= Interface::sizeOf(best)))
+				continue;
+
+			best = block;
+			if (bSize == size)
+				break;
+		}
+		return best ? best : firstFit(size);
+	}
+};
 
 template<class Type, size_t bytes, 
 	template<size_t, class, class> class Policy = ListPolicy>
@@ -290,26 +856,65 @@ public:
 	using value_type		= Type;
 
 private:
-	inline static OurPolicy storage;
+	OurPolicy* storage;
 	static constexpr size_t size = bytes;
 
+	template<class U, size_t, template<size_t, class, class> class>
+	friend class FreeList;
+
+	void decRef() noexcept
+	{
+		if (!--storage->refCount)
+			delete storage;
+	}
+
 public:
 
-	FreeList() = default;
+	// Every FreeList made this way gets its own arena. Copies
+	// (and rebound copies) share it, the last one frees it
+	FreeList() :
+		storage{ new OurPolicy{} }
+	{}
+
+	FreeList(const FreeList& other) noexcept :
+		storage{ other.storage }
+	{
+		++storage->refCount;
+	}
 
 	template<class U>
-	FreeList(const FreeList<U, bytes, Policy>& other) {} // Note: Needed for debug mode to compile with std::containers
+	FreeList(const FreeList<U, bytes, Policy>& other) noexcept :
+		storage{ other.storage }
+	{
+		++storage->refCount;
+	}
+
+	FreeList& operator=(const FreeList& other) noexcept
+	{
+		if (storage != other.storage)
+		{
+			decRef();
+			storage = other.storage;
+			++storage->refCount;
+		}
+		return *this;
+	}
+
+	~FreeList()
+	{
+		decRef();
+	}
 
 	template<class U>
 	bool operator==(const FreeList<U, bytes, Policy>& other) const noexcept
 	{
-		return true;
+		return storage == other.storage;
 	}
 
 	template<class U>
 	bool operator!=(const FreeList<U, bytes, Policy>& other) const noexcept
 	{
-		return false;
+		return !(*this == other);
 	}
 
 	template<class U>
@@ -318,18 +923,55 @@ public:
 	template<class T = Type>
 	T* allocate(size_type count = 1)
 	{
-		return storage.allocate<T>(static_cast<size_type>(count));
+		return storage->template allocate<T>(static_cast<size_type>(count));
 	}
 
 	template<class T = Type>
 	void deallocate(T* ptr, size_type n)
 	{
-		storage.deallocate(ptr);
+		storage->deallocate(ptr);
+	}
+
+	// Grow the allocation at ptr in place into the free
+	// block directly after it (shrinking always succeeds)
+	template<class T = Type>
+	bool try_expand(T* ptr, size_type, size_type newCount)
+	{
+		return storage->try_expand(reinterpret_cast<byte*>(ptr), sizeof(T) * newCount);
+	}
+
+	// Resize the allocation, only copying the contents
+	// when try_expand fails. T must be trivially copyable
+	template<class T = Type>
+	T* reallocate(T* ptr, size_type oldCount, size_type newCount)
+	{
+		static_assert(std::is_trivially_copyable_v<T>, "reallocate copies bytes, T must be trivially copyable");
+
+		if (try_expand(ptr, oldCount, newCount))
+			return ptr;
+
+		T* mem = allocate<T>(newCount);
+		std::memcpy(mem, ptr, sizeof(T) * std::min(oldCount, newCount));
+		deallocate(ptr, oldCount);
+		return mem;
+	}
+
+	// First fit by default. Changes the search for
+	// every FreeList sharing this one's arena
+	void setSearch(FreeListImpl::AlSearch search)
+	{
+		storage->search = search;
 	}
 
 	void freeAll()
 	{
-		storage.freeAll();
+		storage->freeAll();
+	}
+
+	// For checking on the arena's blocks and free bytes
+	const OurPolicy& arena() const noexcept
+	{
+		return *storage;
 	}
 };
 	
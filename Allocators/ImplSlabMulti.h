@@ -1,7 +1,13 @@
 #pragma once
 #include "SmpContainer.h"
 #include "SlabMultiDispatcher.h"
+#include "BiasedMutex.h"
+#include "ThreadRegistry.h"
 #include <thread>
+#include <tuple>
+#include <cstring>
+#include <numeric>
+#include <shared_mutex>
 
 namespace alloc
 {
@@ -39,6 +45,7 @@ private:
 	// TODO: Reorganize for size
 	size_type				blockSize;	// Size of the blocks the super block is divided into
 	size_type				count;		// TODO: This can be converted to IndexSizeT 
+	size_type				untouched;	// Blocks at or above this index have never been handed out (zero filled if the Slab started zeroed)
 	std::vector<IndexSizeT>	availible;	// list of avalible indicies (foreign threads never touch this)
 	std::list<IndexSizeT>	foreigns;	// list of deallocations made by foreign threads
 	SpinLock				spinLock;	// Spinlock for foreigns
@@ -47,10 +54,11 @@ public:
 
 	Slab() = default;
 
-	Slab(size_t blockSize, size_t count) noexcept :
+	Slab(size_t blockSize, size_t count, bool zeroed) noexcept :
 		blockSize{	blockSize				},
 		count{		count					},
-		availible{	dispatcher.getIndicies(blockSize) },
+		untouched{	zeroed ? 0 : count		},
+		availible{	buildIndicies(count)	},
 		foreigns{},
 		spinLock{}
 	{}
@@ -58,6 +66,7 @@ public:
 	Slab(const Slab& other) noexcept :
 		blockSize{	other.blockSize },
 		count{		other.count		},
+		untouched{	other.untouched	},
 		availible{	other.availible },
 		foreigns{	other.foreigns	},
 		spinLock{}
@@ -66,6 +75,7 @@ public:
 	Slab(Slab&& other) noexcept :
 		blockSize{	other.blockSize				},
 		count{		other.count					},
+		untouched{	other.untouched				},
 		availible{	std::move(other.availible)	},
 		foreigns{	std::move(other.foreigns)	},
 		spinLock{}
@@ -75,6 +85,7 @@ public:
 	{
 		blockSize	= other.blockSize;
 		count		= other.count;
+		untouched	= other.untouched;
 		availible	= std::move(other.availible);
 		foreigns	= std::move(other.foreigns);
 		return *this;
@@ -96,11 +107,22 @@ public:
 	// Can only be used safely while holding a non-shared lock on Cache
 	size_type full()			noexcept { return availible.empty() && foreigns.empty(); }
 
-	std::pair<byte*, bool> allocate(byte* mem)
+	// Returns the block, whether the Slab might now be full, 
+	// and whether the block is known to be zero filled.
+	//
+	// Indices are handed out lowest first on a new Slab and reused
+	// indices are always at the back, so anything at or past 
+	// untouched has never been written to
+	std::tuple<byte*, bool, bool> allocate(byte* mem)
 	{
 		auto idx = availible.back();
 		availible.pop_back();
-		return { mem + (idx * blockSize), availible.empty() };
+
+		const bool zeroed = idx >= untouched;
+		if (zeroed)
+			untouched = idx + 1;
+
+		return { mem + (idx * blockSize), availible.empty(), zeroed };
 	}
 
 	template<class P>
@@ -125,6 +147,15 @@ public:
 		foreigns.clear();
 	}
 
+	// Indices are stored in reverse so the lowest
+	// index is at the back and handed out first
+	static std::vector<IndexSizeT> buildIndicies(size_type count)
+	{
+		std::vector<IndexSizeT> v(count);
+		std::iota(std::rbegin(v), std::rend(v), 0);
+		return v;
+	}
+
 	// TODO: Look into holding mem outside this class in a vector for faster access!
 	static bool containsMem(byte* ptr, byte* mem, size_t blockSize, size_t count) noexcept
 	{
@@ -143,19 +174,20 @@ class Cache
 	using SIt			= Container<Slab>::iterator;
 	using MIt			= Container<byte*>::iterator;
 
-	using SharedMutex	= alloc::SharedMutex<32>;
+	using Mutex			= alloc::BiasedMutex;	// Almost all locking is done by the thread that owns the Cache
 
 	// TODO: Reorder for padding size
 	std::atomic<size_type>		mySize;
 	size_type					myCapacity;
 	const size_type				count;
 	const size_type				blockSize;
+	const int					spanOrder;	// Slabs span 2^spanOrder SLAB_SIZE blocks
 	int							threshold;
 	Container<Slab>				slabs;
 	Container<byte*>			ptrs;		// Vector of the memory the Slabs manage (in same order as Slab vec)
 	SIt							actBlock;	// Slab iterator to active block
 	MIt							actMem;		// Mem  iterator to active block
-	SharedMutex					mutex;
+	Mutex						mutex;
 
 	static constexpr double		freeThreshold	= 0.25;
 	static constexpr int		MIN_SLABS		= 1;
@@ -164,11 +196,12 @@ public:
 
 	friend struct Bucket;
 
-	Cache(size_type count, size_type blockSize) :
+	Cache(size_type count, size_type blockSize, int spanOrder) :
 		mySize{		0			},
 		myCapacity{ 0			},
 		count{		count		},
 		blockSize{	blockSize	},
+		spanOrder{	spanOrder	},
 		threshold{	static_cast<int>(count * freeThreshold) },
 		slabs{					},
 		ptrs{					},
@@ -184,24 +217,25 @@ public:
 		myCapacity{ other.myCapacity			},
 		count{		other.count					},
 		blockSize{	other.blockSize				},
+		spanOrder{	other.spanOrder				},
 		threshold{	other.threshold				},
 		slabs{		std::move(other.slabs)		},
 		ptrs{		std::move(other.ptrs)		},	
 		actBlock{	std::move(other.actBlock)	},
+		actMem{		std::move(other.actMem)		},
 		mutex{		std::move(other.mutex)		}
 	{}
 
-	Cache(const Cache& other) : // TODO: Why is this needed?
-		mySize{		other.mySize.load(std::memory_order_relaxed) },
-		myCapacity{ other.myCapacity	},
-		count{		other.count			},
-		blockSize{	other.blockSize		},
-		threshold{	other.threshold		},
-		slabs{		other.slabs			},
-		ptrs{		other.ptrs			},
-		actBlock{	other.actBlock		},
-		mutex{}
-	{}
+	// Copying would hand the same Slabs back to the Dispatcher twice
+	Cache(const Cache& other) = delete;
+
+	// Give our Slabs back to the Dispatcher so they can be reused
+	// by other allocators. Anything still allocated from them is lost
+	~Cache()
+	{
+		for (auto* mem : ptrs)
+			dispatcher().returnBlock(mem, spanOrder);
+	}
 
 private:
 
@@ -219,55 +253,54 @@ private:
 		pos = std::begin(cont) + (static_cast<size_t>(pos - std::begin(cont)) + 1);
 	}
 
+	// mutex must be held exclusively
 	void spliceBoth(SIt& spos, MIt &mpos, SIt sit, MIt mit)
 	{
-		std::lock_guard lock(mutex);
 		splice<SIt, Slab >(spos, sit, slabs);
 		splice<MIt, byte*>(mpos, mit, ptrs);
 	}
 
 	void addCache()
 	{
-		slabs.emplace_back(blockSize, count);
-		ptrs.emplace_back(dispatcher.getBlock());
+		auto[mem, zeroed] = dispatcher().getBlock(spanOrder);
+		slabs.emplace_back(blockSize, count, zeroed);
+		ptrs.emplace_back(mem);
 
 		myCapacity += count;
 	}
 
+	// mutex must be held exclusively
 	void memToDispatch(SIt sit, MIt mit)
 	{
-		std::lock_guard lock(mutex);
-		myCapacity -= count;
-
-		if (sit != actBlock)
+		// Something may have been allocated from the Slab since we checked
+		// it, the owner allocates under a shared lock that only this
+		// exclusive one keeps out.
+		// An empty active block is kept, it's the next one we allocate from
+		// (and every Slab after it might be full)
+		if (!sit->empty() || sit == actBlock)
+			return;
+
+		byte* mem	= *mit;
+		myCapacity	-= count;
+
+		if (sit > actBlock)
 		{
-			if (sit > actBlock)
-			{
-				std::swap(*sit, slabs.back());
-				std::swap(*mit, ptrs.back());
-				slabs.pop_back();
-				ptrs.pop_back();
-			}
-			else
-			{
-				auto idx = static_cast<size_t>(actBlock - std::begin(slabs)) - 1;
-				slabs.erase(sit);
-				ptrs.erase(mit);
-
-				actBlock	= std::begin(slabs) + idx;
-				actMem		= std::begin(ptrs)  + idx;
-			}
+			std::swap(*sit, slabs.back());
+			std::swap(*mit, ptrs.back());
+			slabs.pop_back();
+			ptrs.pop_back();
 		}
 		else
 		{
-			std::swap(*actBlock, slabs.back());
-			std::swap(*actMem, ptrs.back());
-			slabs.pop_back();
-			ptrs.pop_back();
+			auto idx = static_cast<size_t>(actBlock - std::begin(slabs)) - 1;
+			slabs.erase(sit);
+			ptrs.erase(mit);
 
-			actBlock	= std::end(slabs) - 1;
-			actMem		= std::end(ptrs) - 1;
+			actBlock	= std::begin(slabs) + idx;
+			actMem		= std::begin(ptrs)  + idx;
 		}
+
+		dispatcher().returnBlock(mem, spanOrder);
 	}
 
 	template<class It, class Cont>
@@ -282,12 +315,79 @@ private:
 		return std::begin(cont) + index;
 	}
 
+	// Look at the active block first, then the fuller blocks after it
+	// after that start over from the beginning. mutex must be held (shared is enough)
+	MIt findSlab(byte* ptr)
+	{
+		// TODO: Why not keep each Slab in memory sorted order AS WELL as holding
+		// on to an active block? Also, keep a vector of the idx of the next non-full Slab
+		// so search time is constant (and pop_back from vec when our active block is full)
+		auto mit = actMem;
+		for (auto E = std::end(ptrs);;)
+		{
+			if (Slab::containsMem(ptr, *mit, blockSize, count))
+				return mit;
+
+			if (++mit == E)
+			{
+				mit = std::begin(ptrs);
+
+				// If we've searched the whole vector we didn't find the Slab
+				if (E == actMem || mit == actMem)
+					return std::end(ptrs);
+
+				E	= actMem;
+			}
+		}
+	}
+
+	enum SlabMove { STAY, SPLICE, DISPATCH };
+
+	// What (if anything) should happen to a Slab after a deallocation
+	SlabMove slabMove(SIt it)
+	{
+		// Combine the operations because we almost always need both
+		// empty and size, and they both require obtaining a spinLock in the Slab
+		auto[empty, size] = it->emptyAndSize();
+
+		// If the Slab is empty enough place it before the active block
+		if (size <= static_cast<size_type>(threshold)
+			&& it > actBlock)
+			return SPLICE;
+
+		// Return memory to Dispatcher
+		if (empty
+			&& slabs.size() > MIN_SLABS
+			&& mySize > myCapacity - count)
+			return DISPATCH;
+
+		return STAY;
+	}
+
+	// mutex must be held exclusively
+	void moveSlab(SlabMove move, SIt it, MIt mit)
+	{
+		if (move == SPLICE)
+			spliceBoth(actBlock, actMem, it, mit);
+		else if (move == DISPATCH)
+			memToDispatch(it, mit);
+	}
+
 public:
 
-	// No other threads will ever be in this function	
-	byte* allocate()
+	// No other threads will ever be in this function.
+	// Returns the memory and whether it's known to be zero filled
+	std::pair<byte*, bool> allocate()
 	{
-		auto[mem, possiblyFull] = actBlock->allocate(*actMem);
+		byte*	mem;
+		bool	possiblyFull;
+		bool	zeroed;
+		{
+			// Remote deallocations can move Slabs (and actBlock) while holding
+			// the lock exclusively. Shared locking is nearly free for the owner
+			std::shared_lock lock(mutex);
+			std::tie(mem, possiblyFull, zeroed) = actBlock->allocate(*actMem);
+		}
 
 		// If active block is full, create a new one and add
 		// it to the list before the previous AB
@@ -322,63 +422,63 @@ public:
 
 		theEnd:
 		mySize.fetch_add(1, std::memory_order_relaxed); // TODO: This atomic decreases speed by ~ 4%
-		return mem;
+		return { mem, zeroed };
 	}
 
 	template<class T>
 	bool deallocate(T* ptr, bool thisThread)
 	{
-		// Look at the active block first, then the fuller blocks after it
-		// after that start over from the beginning
+		auto* p = reinterpret_cast<byte*>(ptr);
 
-		std::shared_lock slock(mutex);
+		// Only the owner touches a Slab's availible list, so it holds an upgrade
+		// lock throughout and nothing can move under it before it goes exclusive
+		if (thisThread)
+		{
+			alloc::UpgradeLock ulock(mutex);
 
-		// TODO: Why not keep each Slab in memory sorted order AS WELL as holding
-		// on to an active block? Also, keep a vector of the idx of the next non-full Slab
-		// so search time is constant (and pop_back from vec when our active block is full)
+			auto mit = findSlab(p);
+			if (mit == std::end(ptrs))
+				return false;
 
-		SIt it;
-		auto mit = actMem;
-		for (auto E = std::end(ptrs);;)
-		{
-			if (Slab::containsMem(reinterpret_cast<byte*>(ptr), *mit, blockSize, count))
+			auto it = itFromIdx(getItIndex(mit, ptrs), slabs);
+			it->deallocate(ptr, *mit, true);
+
+			if (auto move = slabMove(it); move != STAY)
 			{
-				it = itFromIdx(getItIndex(mit, ptrs), slabs);
-				it->deallocate(ptr, *mit, thisThread);
-				break;
+				ulock.upgrade();
+				moveSlab(move, it, mit);
 			}
+		}
 
-			if (++mit == E)
+		// Foreign threads only search under a shared lock so they don't serialize
+		// each other. If the Slab needs moving we lock exclusively and look again,
+		// it may have moved (or been handed back) while we weren't holding the lock
+		else
+		{
+			SlabMove move;
 			{
-				mit = std::begin(ptrs);
+				std::shared_lock slock(mutex);
 
-				// If we've searched the whole vector we didn't find the Slab
-				if (E == actMem || mit == actMem)
+				auto mit = findSlab(p);
+				if (mit == std::end(ptrs))
 					return false;
 
-				E	= actMem;
+				auto it = itFromIdx(getItIndex(mit, ptrs), slabs);
+				it->deallocate(ptr, *mit, false);
+				move = slabMove(it);
 			}
-		}
-
-		// Combine the operations because we almost always need both
-		// empty and size, and they both require obtaining a spinLock in the Slab
-		auto[empty, size] = it->emptyAndSize();
-
-		// If the Slab is empty enough place it before the active block
-		if (size <= threshold
-			&& it > actBlock)
-		{
-			slock.unlock();
-			spliceBoth(actBlock, actMem, it, mit);
-		}
 
-		// Return memory to Dispatcher
-		else if (empty
-			&& slabs.size() > MIN_SLABS
-			&& mySize > myCapacity - count)
-		{
-			slock.unlock();
-			memToDispatch(it, mit);
+			if (move != STAY)
+			{
+				std::lock_guard lock(mutex);
+
+				auto mit = findSlab(p);
+				if (mit != std::end(ptrs))
+				{
+					auto it = itFromIdx(getItIndex(mit, ptrs), slabs);
+					moveSlab(slabMove(it), it, mit);
+				}
+			}
 		}
 
 		mySize.fetch_sub(1, std::memory_order_relaxed);
@@ -387,6 +487,16 @@ public:
 		// we destroy the bucket
 		return true;
 	}
+
+	// Returns blockSize if ptr lives in one of our Slabs, 0 otherwise
+	size_type usableSize(byte* ptr)
+	{
+		std::shared_lock slock(mutex);
+		for (auto* mem : ptrs)
+			if (Slab::containsMem(ptr, mem, blockSize, count))
+				return blockSize;
+		return 0;
+	}
 };
 
 // Bucket of Caches
@@ -406,7 +516,7 @@ public:
 	{
 		caches.reserve(NUM_CACHES);
 		for (int i = 0; i < NUM_CACHES; ++i)
-			caches.emplace_back(blocksPerSlab[i], cacheSizes[i]);
+			caches.emplace_back(blocksPerSlab[i], cacheSizes[i], spanOrders[i]);
 	}
 
 	Bucket(Bucket&& other) noexcept :
@@ -420,9 +530,27 @@ public:
 	byte* allocate(int idx, size_type bytes)
 	{
 		if (idx >= FOUND)
-			return caches[idx].allocate();
+			return caches[idx].allocate().first;
 
-		return reinterpret_cast<byte*>(operator new(bytes));
+		return allocateLarge(bytes);
+	}
+
+	// Only clears the memory if it isn't already known to be zero
+	byte* allocateZeroed(int idx, size_type bytes)
+	{
+		if (idx >= FOUND)
+		{
+			auto[mem, zeroed] = caches[idx].allocate();
+			if (!zeroed)
+				std::memset(mem, 0, bytes);
+			return mem;
+		}
+
+		// Directly mapped memory is always fresh
+		byte* mem = allocateLarge(bytes);
+		if (bytes < DIRECT_MAP_SIZE)
+			std::memset(mem, 0, bytes);
+		return mem;
 	}
 
 	template<class T>
@@ -431,9 +559,31 @@ public:
 		if (idx >= FOUND)
 			return caches[idx].deallocate(ptr, thisThread);
 
-		operator delete(ptr, bytes);
+		if (bytes >= DIRECT_MAP_SIZE)
+			alloc::osFree(reinterpret_cast<byte*>(ptr), bytes);
+		else
+			operator delete(ptr, bytes);
 		return true;
 	}
+
+private:
+
+	static byte* allocateLarge(size_type bytes)
+	{
+		if (bytes >= DIRECT_MAP_SIZE)
+			return alloc::osAlloc(bytes);
+		return reinterpret_cast<byte*>(operator new(bytes));
+	}
+
+public:
+
+	size_type usableSize(byte* ptr)
+	{
+		for (auto& cache : caches)
+			if (auto size = cache.usableSize(ptr))
+				return size;
+		return 0;
+	}
 };
 
 } // End ImplSlabMulti::
\ No newline at end of file
@@ -0,0 +1,452 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <type_traits>
+#include "AllocHelpers.h"
+#include "SmpContainer.h"
+
+namespace ImplLockFree
+{
+
+constexpr size_t cacheLine = std::hardware_constructive_interference_size;
+
+} // End ImplLockFree::
+
+namespace alloc
+{
+
+// Thread aware object pool for lock free containers. Like SlabObj objects
+// are constructed once when their slab is made and only destroyed with the pool,
+// so a node that's been given back is still a valid node. That's what lets
+// containers read a node another thread may have just popped (their tags catch the ABA).
+//
+// Each thread keeps its own free list. Once it's holding more than localCap
+// the whole list goes to a shared stack, which threads that run dry
+// take from in one exchange (no pops, so no ABA)
+template<class T, size_t slabObjs = 256, size_t localCap = 512, class Al = alloc::SlabMulti<std::byte>>
+class NodePool
+{
+	static_assert(std::is_default_constructible_v<T>, "NodePool constructs its objects up front");
+
+	// obj has to be first, T* and Block* are the same address
+	struct Block
+	{
+		T		obj;
+		Block*	link;
+	};
+
+	struct Local
+	{
+		Block*	head	= nullptr;
+		Block*	tail	= nullptr;
+		size_t	count	= 0;
+	};
+
+	using BlockAl	= typename std::allocator_traits<Al>::template rebind_alloc<Block>;
+	using Traits	= std::allocator_traits<BlockAl>;
+	using Locals	= alloc::SmpMap<size_t, Local, alloc::RcuPolicy>;
+	using Slabs		= alloc::SmpVector<Block*, alloc::SegmentedPolicy<BlockAl>>;
+
+	// al comes before slabs, they share it
+	std::atomic<Block*>		shared;
+	BlockAl					al;
+	Slabs					slabs;
+	Locals					locals;
+
+	Local& local()
+	{
+		const auto id	= alloc::ThreadRegistry::index();
+		Local* l		= locals.findDo(id, [](auto it, auto& cont) -> Local*
+		{
+			return it != std::end(cont) ? &it->second : nullptr;
+		});
+		return l ? *l : locals.emplace(id);
+	}
+
+	// Chain from head to tail
+	void pushShared(Block* head, Block* tail) noexcept
+	{
+		Block* old = shared.load(std::memory_order_relaxed);
+		do
+		{
+			tail->link = old;
+		} while (!shared.compare_exchange_weak(old, head, std::memory_order_release, std::memory_order_relaxed));
+	}
+
+	void refill(Local& l)
+	{
+		if (Block* chain = shared.exchange(nullptr, std::memory_order_acquire))
+		{
+			l.head = chain;
+			for (l.count = 1; chain->link; chain = chain->link)
+				++l.count;
+			l.tail = chain;
+			return;
+		}
+
+		Block* slab = Traits::allocate(al, slabObjs);
+		for (size_t i = 0; i < slabObjs; ++i)
+		{
+			Traits::construct(al, &slab[i].obj);
+			slab[i].link = i + 1 < slabObjs ? &slab[i + 1] : nullptr;
+		}
+		slabs.emplace_back(slab);
+
+		l.head	= slab;
+		l.tail	= &slab[slabObjs - 1];
+		l.count = slabObjs;
+	}
+
+public:
+
+	explicit NodePool(const Al& al = Al{}) :
+		shared{ nullptr		},
+		al{		al			},
+		slabs{	this->al	},
+		locals{}
+	{}
+
+	~NodePool()
+	{
+		slabs.iterate([&](Block* slab)
+		{
+			for (size_t i = 0; i < slabObjs; ++i)
+				Traits::destroy(al, &slab[i].obj);
+			Traits::deallocate(al, slab, slabObjs);
+			return false;
+		});
+	}
+
+	NodePool(const NodePool& other)				= delete;
+	NodePool& operator=(const NodePool& other)	= delete;
+
+	T* allocate()
+	{
+		Local& l = local();
+		if (!l.head)
+			refill(l);
+
+		Block* b	= l.head;
+		l.head		= b->link;
+		--l.count;
+		return &b->obj;
+	}
+
+	void deallocate(T* ptr)
+	{
+		Local& l	= local();
+		Block* b	= reinterpret_cast<Block*>(ptr);
+		b->link		= l.head;
+		l.head		= b;
+		if (!l.count++)
+			l.tail = b;
+
+		if (l.count >= localCap)
+		{
+			pushShared(l.head, l.tail);
+			l.head	= l.tail = nullptr;
+			l.count = 0;
+		}
+	}
+};
+
+// Treiber stack. Nodes come from a NodePool
+// and the head is tagged so a recycled node can't fool a pop
+template<class T>
+class LockFreeStack
+{
+	using TaggedPtr = alloc::TaggedPtr;
+
+	struct Node
+	{
+		std::atomic<Node*>				next{ nullptr };
+		alignas(T) unsigned char		storage[sizeof(T)];
+
+		T& value() noexcept { return *reinterpret_cast<T*>(storage); }
+	};
+
+	alignas(ImplLockFree::cacheLine) std::atomic<TaggedPtr::value_type>	head;
+	NodePool<Node>														pool;
+
+public:
+
+	LockFreeStack() :
+		head{ 0 },
+		pool{}
+	{}
+
+	~LockFreeStack()
+	{
+		for (Node* node = TaggedPtr{ head.load(std::memory_order_relaxed) }.ptr<Node>(); node;
+			node = node->next.load(std::memory_order_relaxed))
+			node->value().~T();
+	}
+
+	LockFreeStack(const LockFreeStack& other)				= delete;
+	LockFreeStack& operator=(const LockFreeStack& other)	= delete;
+
+	template<class... Args>
+	void push(Args&& ...args)
+	{
+		Node* node = pool.allocate();
+		new (node->storage) T(std::forward<Args>(args)...);
+
+		auto old = head.load(std::memory_order_relaxed);
+		do
+		{
+			node->next.store(TaggedPtr{ old }.ptr<Node>(), std::memory_order_relaxed);
+		} while (!head.compare_exchange_weak(old, TaggedPtr{ node, TaggedPtr{ old }.tag() + 1 }.raw(),
+			std::memory_order_release, std::memory_order_relaxed));
+	}
+
+	bool pop(T& out)
+	{
+		auto old = head.load(std::memory_order_acquire);
+		for (;;)
+		{
+			TaggedPtr top{ old };
+			Node* node = top.ptr<Node>();
+			if (!node)
+				return false;
+
+			// node may have been popped (and reused) by now, then
+			// next is junk but the tag has moved on and the CAS fails
+			Node* nxt = node->next.load(std::memory_order_relaxed);
+			if (head.compare_exchange_weak(old, TaggedPtr{ nxt, top.tag() + 1 }.raw(),
+				std::memory_order_acquire, std::memory_order_acquire))
+			{
+				out = std::move(node->value());
+				node->value().~T();
+				pool.deallocate(node);
+				return true;
+			}
+		}
+	}
+
+	bool empty() const noexcept
+	{
+		return !TaggedPtr{ head.load(std::memory_order_acquire) }.ptr<Node>();
+	}
+};
+
+// Unbounded MPMC queue (Michael & Scott) with tagged head, tail
+// and links, nodes come from a NodePool.
+//
+// A dequeuer has to read the value before its CAS, while another thread
+// might be reusing the node, so values are kept in std::atomic<T> and T has to be
+// trivially copyable. Queue pointers to anything bigger
+template<class T>
+class LockFreeQueue
+{
+	static_assert(std::is_trivially_copyable_v<T>, "LockFreeQueue values must be trivially copyable");
+
+	using TaggedPtr = alloc::TaggedPtr;
+	using Tagged	= TaggedPtr::value_type;
+
+	struct Node
+	{
+		std::atomic<Tagged>	next{ 0 };
+		std::atomic<T>		value{};
+	};
+
+	alignas(ImplLockFree::cacheLine) std::atomic<Tagged>	head;
+	alignas(ImplLockFree::cacheLine) std::atomic<Tagged>	tail;
+	NodePool<Node>											pool;
+
+	static Node* ptr(Tagged t) noexcept { return TaggedPtr{ t }.ptr<Node>(); }
+	static Tagged tag(Tagged t) noexcept { return TaggedPtr{ t }.tag(); }
+
+public:
+
+	LockFreeQueue() :
+		head{ 0 },
+		tail{ 0 },
+		pool{}
+	{
+		Node* dummy = pool.allocate();
+		dummy->next.store(0, std::memory_order_relaxed);
+		head.store(TaggedPtr{ dummy, 0 }.raw(), std::memory_order_relaxed);
+		tail.store(TaggedPtr{ dummy, 0 }.raw(), std::memory_order_relaxed);
+	}
+
+	LockFreeQueue(const LockFreeQueue& other)				= delete;
+	LockFreeQueue& operator=(const LockFreeQueue& other)	= delete;
+
+	void push(const T& val)
+	{
+		Node* node = pool.allocate();
+		node->value.store(val, std::memory_order_relaxed);
+
+		// Keep the link's tag counting up across reuses
+		Tagged link = node->next.load(std::memory_order_relaxed);
+		node->next.store(TaggedPtr{ nullptr, tag(link) + 1 }.raw(), std::memory_order_relaxed);
+
+		Tagged t;
+		for (;;)
+		{
+			t				= tail.load(std::memory_order_acquire);
+			Tagged next		= ptr(t)->next.load(std::memory_order_acquire);
+			if (t != tail.load(std::memory_order_acquire))
+				continue;
+
+			if (!ptr(next))
+			{
+				if (ptr(t)->next.compare_exchange_weak(next, TaggedPtr{ node, tag(next) + 1 }.raw(),
+					std::memory_order_release, std::memory_order_relaxed))
+					break;
+			}
+			else // Tail is behind, help it along
+				tail.compare_exchange_weak(t, TaggedPtr{ ptr(next), tag(t) + 1 }.raw(),
+					std::memory_order_release, std::memory_order_relaxed);
+		}
+		tail.compare_exchange_strong(t, TaggedPtr{ node, tag(t) + 1 }.raw(),
+			std::memory_order_release, std::memory_order_relaxed);
+	}
+
+	bool pop(T& out)
+	{
+		for (;;)
+		{
+			Tagged h	= head.load(std::memory_order_acquire);
+			Tagged t	= tail.load(std::memory_order_acquire);
+			Tagged next = ptr(h)->next.load(std::memory_order_acquire);
+			if (h != head.load(std::memory_order_acquire))
+				continue;
+
+			if (ptr(h) == ptr(t))
+			{
+				if (!ptr(next))
+					return false;
+
+				tail.compare_exchange_weak(t, TaggedPtr{ ptr(next), tag(t) + 1 }.raw(),
+					std::memory_order_release, std::memory_order_relaxed);
+				continue;
+			}
+
+			const T val = ptr(next)->value.load(std::memory_order_relaxed);
+			if (head.compare_exchange_weak(h, TaggedPtr{ ptr(next), tag(h) + 1 }.raw(),
+				std::memory_order_acq_rel, std::memory_order_relaxed))
+			{
+				out = val;
+				pool.deallocate(ptr(h));
+				return true;
+			}
+		}
+	}
+
+	bool empty() const noexcept
+	{
+		return !ptr(ptr(head.load(std::memory_order_acquire))->next.load(std::memory_order_acquire));
+	}
+};
+
+// Bounded MPMC queue (Vyukov). Every cell has a sequence number saying
+// whose turn it is, so producers and consumers only contend on their own
+// position counter. capacity is rounded up to a power of 2
+template<class T, class Al = std::allocator<T>>
+class BoundedQueue
+{
+	struct Cell
+	{
+		std::atomic<size_t>				seq;
+		alignas(T) unsigned char		storage[sizeof(T)];
+
+		T& value() noexcept { return *reinterpret_cast<T*>(storage); }
+	};
+
+	using CellAl	= typename std::allocator_traits<Al>::template rebind_alloc<Cell>;
+	using Traits	= std::allocator_traits<CellAl>;
+
+	CellAl													al;
+	const size_t											mask;
+	Cell*													cells;
+	alignas(ImplLockFree::cacheLine) std::atomic<size_t>	enqueuePos;
+	alignas(ImplLockFree::cacheLine) std::atomic<size_t>	dequeuePos;
+
+	static size_t roundUp(size_t n) noexcept
+	{
+		return n < 2 ? 2 : size_t{ 1 } << (alloc::highestSetBit(n - 1) + 1);
+	}
+
+public:
+
+	explicit BoundedQueue(size_t capacity, const Al& al = Al{}) :
+		al{			al								},
+		mask{		roundUp(capacity) - 1			},
+		cells{		Traits::allocate(this->al, mask + 1) },
+		enqueuePos{ 0								},
+		dequeuePos{ 0								}
+	{
+		for (size_t i = 0; i <= mask; ++i)
+			new (&cells[i].seq) std::atomic<size_t>{ i };
+	}
+
+	~BoundedQueue()
+	{
+		const size_t end = enqueuePos.load(std::memory_order_relaxed);
+		for (size_t pos = dequeuePos.load(std::memory_order_relaxed); pos != end; ++pos)
+			cells[pos & mask].value().~T();
+		Traits::deallocate(al, cells, mask + 1);
+	}
+
+	BoundedQueue(const BoundedQueue& other)				= delete;
+	BoundedQueue& operator=(const BoundedQueue& other)	= delete;
+
+	// Returns false if the queue is full
+	template<class... Args>
+	bool push(Args&& ...args)
+	{
+		size_t pos = enqueuePos.load(std::memory_order_relaxed);
+		for (;;)
+		{
+			Cell& cell		= cells[pos & mask];
+			const auto seq	= cell.seq.load(std::memory_order_acquire);
+			const auto diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos);
+
+			if (!diff)
+			{
+				if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				{
+					new (cell.storage) T(std::forward<Args>(args)...);
+					cell.seq.store(pos + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if (diff < 0)
+				return false;
+			else
+				pos = enqueuePos.load(std::memory_order_relaxed);
+		}
+	}
+
+	// Returns false if the queue is empty
+	bool pop(T& out)
+	{
+		size_t pos = dequeuePos.load(std::memory_order_relaxed);
+		for (;;)
+		{
+			Cell& cell		= cells[pos & mask];
+			const auto seq	= cell.seq.load(std::memory_order_acquire);
+			const auto diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos + 1);
+
+			if (!diff)
+			{
+				if (dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				{
+					out = std::move(cell.value());
+					cell.value().~T();
+					cell.seq.store(pos + mask + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if (diff < 0)
+				return false;
+			else
+				pos = dequeuePos.load(std::memory_order_relaxed);
+		}
+	}
+
+	size_t capacity() const noexcept { return mask + 1; }
+};
+
+} // End alloc::
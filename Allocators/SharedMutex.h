@@ -2,268 +2,815 @@
 #include <atomic>
 #include <thread>
 #include <chrono>
-#include <array>
-#include <unordered_map>
+#include <type_traits>
 #include "AllocHelpers.h"
+#include "ThreadRegistry.h"
 
 namespace ImplSharedMutex
 {
-struct ContentionFreeFlag 
+struct ContentionFreeFlag
 {
 	enum Flags
 	{
-		Unregistered,
-		Registered,
-		PrepareLock,
-		SharedLock
+		Unlocked,
+		SharedLock,
+		SharedLockWaited	// Shared locked and a writer is parked on the flag
 	};
 
 	ContentionFreeFlag() noexcept :
-		id{},
-		flag{ Unregistered }
+		flag{ Unlocked }
 	{}
 
 	ContentionFreeFlag(ContentionFreeFlag&& other) noexcept :
-		id{ std::move(other.id) },
 		flag{ other.flag.load() }
 	{}
 
-	std::thread::id			id;
 	std::atomic<int>		flag;
-	static constexpr auto	SizeOffset = (sizeof(decltype(id)) + sizeof(decltype(flag)));
+	static constexpr auto	SizeOffset = sizeof(decltype(flag));
 	alloc::byte				noFalseSharing[std::hardware_constructive_interference_size - SizeOffset]; // TODO: Get rid of warning of non-init
 };
+
+// A reader count shared by every thread that doesn't get its own flag
+struct ReaderShard
+{
+	// Set while a writer is parked waiting for the count to drop to 0
+	static constexpr int WAITED = 1 << 30;
+
+	ReaderShard() noexcept :
+		count{ 0 }
+	{}
+
+	std::atomic<int>		count;
+	static constexpr auto	SizeOffset = sizeof(decltype(count));
+	alloc::byte				noFalseSharing[std::hardware_constructive_interference_size - SizeOffset];
+};
+
+// One NUMA node's reader flags, after a count of how many of them are raised.
+// The count is only kept when the mutex is NUMA aware, it lets a writer
+// skip a node's flags (and the cross node traffic of reading them)
+struct NodeReaders
+{
+	ReaderShard summary;
+
+	ContentionFreeFlag* flags() noexcept 
+	{ 
+		return reinterpret_cast<ContentionFreeFlag*>(this + 1); 
+	}
+
+	static size_t bytes(size_t slots) noexcept
+	{
+		return sizeof(NodeReaders) + slots * sizeof(ContentionFreeFlag);
+	}
+
+	// When node is >= 0 the block is allocated on that node
+	static NodeReaders* create(size_t slots, int node)
+	{
+		void* mem = node >= 0 
+			? alloc::osAllocOnNode(bytes(slots), node) 
+			: operator new(bytes(slots));
+
+		auto* nr = new (mem) NodeReaders;
+		for (size_t i = 0; i < slots; ++i)
+			new (nr->flags() + i) ContentionFreeFlag;
+		return nr;
+	}
+
+	static void destroy(NodeReaders* nr, size_t slots, bool onNode) noexcept
+	{
+		if (onNode)
+			alloc::osFree(reinterpret_cast<alloc::byte*>(nr), bytes(slots));
+		else
+			operator delete(nr);
+	}
+};
+
+// How many times we spin (with a pause) before parking the thread
+constexpr int SPIN_LIMIT		= 128;
+
+// Number of ReaderShards threads without a flag are spread across
+constexpr int OVERFLOW_SHARDS	= 8;
+
+// One flag per hardware thread
+inline size_t defaultSlots() noexcept
+{
+	const size_t hw = std::thread::hardware_concurrency();
+	return hw ? hw : 1;
+}
+
 } // End ImplSharedMutex::
 
 namespace alloc
 {
 
+// Contention counters for a lock. Only touched once a thread
+// has to wait, so the uncontended paths don't pay for them
+struct LockStats
+{
+	std::atomic<uint64_t> contended				= 0;	// Times a thread had to wait
+	std::atomic<uint64_t> parks					= 0;	// Times a thread went to sleep in the kernel
+	std::atomic<uint64_t> waitNanos				= 0;	// Total time spent waiting (spinning + parked)
+	std::atomic<uint64_t> readerRetries			= 0;	// Times a reader found a writer in the way and backed off
+	std::atomic<uint64_t> maxWriterWaitNanos	= 0;	// Longest a writer has waited to get the lock
+
+	void recordWriterWait(uint64_t nanos) noexcept
+	{
+		uint64_t prev = maxWriterWaitNanos.load(std::memory_order_relaxed);
+		while (prev < nanos && !maxWriterWaitNanos.compare_exchange_weak(prev, nanos, std::memory_order_relaxed))
+			;
+	}
+};
+
+// SharedMutex policies, who wins when readers and writers are both waiting
+//
+// WriterPreferring:	Once a writer has the spill lock new readers wait for it. Readers can starve
+// ReaderPreferring:	Writers queue without holding readers off, the writer at the
+//						front only shuts readers out once none are in. Writers can starve
+// PhaseFair:			Writer preferring, but readers that were held up by a writer get in before the 
+//						next writer does. Neither side waits for more than one phase of the other
+struct WriterPreferring {};
+struct ReaderPreferring {};
+struct PhaseFair		{};
+
 //
 // The idea for this SharedMutex came from https://www.codeproject.com/Articles/1183423/We-make-a-std-shared-mutex-times-faster
 //
 
 // A write-contention free version of std::shared_mutex
-// threads = number of threads that can be registered
-// before falling back on using a non-write contention free lock
-template<size_t threads = 4>		
+// threads = number of threads that get their own flag (0 = one per
+// hardware thread), it can also be set at runtime through the constructor.
+// Threads whose ThreadRegistry index is >= that share a small set of
+// sharded reader counts, so they still read in parallel but contend a little
+//
+// Waiters spin for a little while and then park on a futex
+// (WaitOnAddress on Windows), both on the spill lock and
+// while a writer drains the reader flags.
+// Meets the SharedTimedMutex requirements (try_ and timed locks), and has
+// an upgrade mode: shared with readers, exclusive with writers and other
+// upgraders, and can be turned into an exclusive lock without letting go
+//
+// numaAware = every NUMA node gets its own set of flags (allocated on the node)
+// plus a summary count. Readers only write lines on their own node, writers
+// skip the flags of nodes without readers. Costs readers an atomic add
+// on the summary, so it's only worth it on multi socket machines
+template<size_t threads = 0, class Policy = WriterPreferring, bool numaAware = false>
 class SharedMutex
 {
-	using CFF = ImplSharedMutex::ContentionFreeFlag;
+	using CFF			= ImplSharedMutex::ContentionFreeFlag;
+	using NodeReaders	= ImplSharedMutex::NodeReaders;
 
-	inline static const auto defaultThreadId = std::thread::id{};
+	static constexpr bool readerPref	= std::is_same_v<Policy, ReaderPreferring>;
+	static constexpr bool phaseFair		= std::is_same_v<Policy, PhaseFair>;
+	static_assert(readerPref || phaseFair || std::is_same_v<Policy, WriterPreferring>, "Unknown SharedMutex policy");
 
-	std::atomic<bool>			spLock;
-	std::array<CFF, threads>*	flags;
+	enum SpillState
+	{
+		Unlocked,
+		Locked,
+		Contended	// Locked and there may be parked threads
+	};
+
+	using Clock		= std::chrono::steady_clock;
+	using Deadline	= Clock::time_point;
+
+	static constexpr Deadline Forever = Deadline::max();
+
+	using Shard = ImplSharedMutex::ReaderShard;
+
+	std::atomic<int>	spLock;
+	std::atomic<int>	upgradeLock;		// Held by writers and upgraders
+	std::atomic<int>	writerIn;			// ReaderPreferring, what readers check instead of spLock
+	std::atomic<int>	blockedReaders;		// PhaseFair, readers waiting on a writer
+	size_t				slots;
+	int					nodes;
+	NodeReaders**		nodeReaders;	// One per node
+	CFF*				flags;			// nodeReaders[0]->flags()
+	Shard*				shards;
+	LockStats			lockStats;
+
+	// Times a wait from construction to destruction,
+	// only built once the fast path has failed
+	struct WaitTimer
+	{
+		WaitTimer(LockStats& stats) :
+			stats{ stats		},
+			start{ Clock::now() }
+		{
+			stats.contended.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		~WaitTimer()
+		{
+			const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start);
+			stats.waitNanos.fetch_add(ns.count(), std::memory_order_relaxed);
+		}
+
+		// Returns false (without parking) once deadline has passed
+		bool park(std::atomic<int>& word, int expected, const Deadline& deadline)
+		{
+			if (deadline == Forever)
+			{
+				stats.parks.fetch_add(1, std::memory_order_relaxed);
+				alloc::futexWait(word, expected);
+				return true;
+			}
+
+			const auto now = Clock::now();
+			if (now >= deadline)
+				return false;
+
+			stats.parks.fetch_add(1, std::memory_order_relaxed);
+			alloc::futexWait(word, expected, deadline - now);
+			return true;
+		}
+
+		LockStats&			stats;
+		Clock::time_point	start;
+	};
 
 public:
 
-	SharedMutex() :
-		spLock{ false },
-		flags{	new std::array<CFF, threads> }
-	{}
+	explicit SharedMutex(size_t readerSlots = threads ? threads : ImplSharedMutex::defaultSlots()) :
+		spLock{ Unlocked									},
+		upgradeLock{ Unlocked								},
+		writerIn{ Unlocked									},
+		blockedReaders{ 0									},
+		slots{	readerSlots									},
+		nodes{	numaAware ? alloc::numaNodes() : 1			},
+		nodeReaders{ new NodeReaders*[nodes]				},
+		flags{	nullptr										},
+		shards{ new Shard[ImplSharedMutex::OVERFLOW_SHARDS]	}
+	{
+		for (int n = 0; n < nodes; ++n)
+			nodeReaders[n] = NodeReaders::create(slots, numaAware ? n : -1);
+		flags = nodeReaders[0]->flags();
+	}
 
 	SharedMutex(SharedMutex&& other) noexcept :
-		spLock{ other.spLock.load()		}, // TODO: std::memory_order_acquire ?
-		flags{	std::move(other.flags)	}
+		spLock{ other.spLock.load()	}, // TODO: std::memory_order_acquire ?
+		upgradeLock{ Unlocked		},
+		writerIn{ Unlocked			},
+		blockedReaders{ 0			},
+		slots{	other.slots			},
+		nodes{	other.nodes			},
+		nodeReaders{ other.nodeReaders },
+		flags{	other.flags			},
+		shards{ other.shards		}
 	{
-		other.flags = nullptr;
+		other.slots			= 0;
+		other.nodes			= 0;
+		other.nodeReaders	= nullptr;
+		other.flags			= nullptr;
+		other.shards		= nullptr;
 	}
 
-	~SharedMutex() { delete flags; }
+	~SharedMutex() 
+	{ 
+		for (int n = 0; n < nodes; ++n)
+			NodeReaders::destroy(nodeReaders[n], slots, numaAware);
+		delete[] nodeReaders;
+		delete[] shards;
+	}
+
+	size_t slotCount() const noexcept { return slots; }
+
+	const LockStats& stats() const noexcept { return lockStats; }
 
 	void lock_shared()
 	{
-		const int idx = registerThread();
+		lockShared(Forever);
+	}
+
+	void unlock_shared()
+	{
+		// TODO: Debug safety check here
+		retract(alloc::ThreadRegistry::index());
+	}
+
+	void lock()
+	{
+		lockExclusive(Forever);
+	}
+
+	void unlock()
+	{
+		// TODO: Debug safety check here
+		openGate();
+		release(upgradeLock);
+	}
+
+	bool try_lock_shared()
+	{
+		return tryEnterShared(alloc::ThreadRegistry::index());
+	}
+
+	template<class Rep, class Period>
+	bool try_lock_shared_for(const std::chrono::duration<Rep, Period>& relTime)
+	{
+		return lockShared(toDeadline(relTime));
+	}
+
+	template<class Clk, class Duration>
+	bool try_lock_shared_until(const std::chrono::time_point<Clk, Duration>& absTime)
+	{
+		return lockShared(toDeadline(absTime));
+	}
+
+	bool try_lock()
+	{
+		if (!tryLockWord(upgradeLock))
+			return false;
+
+		if (tryLockWriter())
+			return true;
+
+		release(upgradeLock);
+		return false;
+	}
+
+	template<class Rep, class Period>
+	bool try_lock_for(const std::chrono::duration<Rep, Period>& relTime)
+	{
+		return lockExclusive(toDeadline(relTime));
+	}
+
+	template<class Clk, class Duration>
+	bool try_lock_until(const std::chrono::time_point<Clk, Duration>& absTime)
+	{
+		return lockExclusive(toDeadline(absTime));
+	}
 
-		// Thread is registered
-		if (idx >= ThreadRegister::Registered)
+	// Upgrade mode. Other upgraders and writers queue on upgradeLock,
+	// so once we have it the only thing an upgrade waits on is readers
+
+	void lock_upgrade()
+	{
+		lockWord(upgradeLock, Forever);
+
+		// Can't block, only upgradeLock holders close the gate
+		lock_shared();
+	}
+
+	bool try_lock_upgrade()
+	{
+		if (!tryLockWord(upgradeLock))
+			return false;
+
+		if (try_lock_shared())
+			return true;
+
+		release(upgradeLock);
+		return false;
+	}
+
+	void unlock_upgrade()
+	{
+		unlock_shared();
+		release(upgradeLock);
+	}
+
+	void unlock_upgrade_and_lock()
+	{
+		// Lower our own flag so we don't wait on ourselves
+		unlock_shared();
+		lockWriter(Forever);
+	}
+
+	void unlock_upgrade_and_lock_shared()
+	{
+		release(upgradeLock);
+	}
+
+	void unlock_and_lock_upgrade()
+	{
+		announce(alloc::ThreadRegistry::index());
+		openGate();
+	}
+
+	void unlock_and_lock_shared()
+	{
+		unlock_and_lock_upgrade();
+		unlock_upgrade_and_lock_shared();
+	}
+
+private:
+
+	template<class Rep, class Period>
+	static Deadline toDeadline(const std::chrono::duration<Rep, Period>& relTime)
+	{
+		const auto now = Clock::now();
+		if (relTime > Deadline::max() - now)
+			return Forever;
+		return now + std::chrono::ceil<Clock::duration>(relTime);
+	}
+
+	// Deadlines on other clocks are converted to a relative time,
+	// same as the standard library does
+	template<class Clk, class Duration>
+	static Deadline toDeadline(const std::chrono::time_point<Clk, Duration>& absTime)
+	{
+		return toDeadline(absTime - Clk::now());
+	}
+
+	// Raise our flag (or count ourselves in a shard)
+	void announce(size_t idx) noexcept
+	{
+		if (idx >= slots)
+			shardFor(idx).count.fetch_add(1, std::memory_order_seq_cst);
+
+		else if constexpr (numaAware)
 		{
-			// Spin until the spill lock is unlocked
-			/*
-			(*flags)[idx].flag.store(CFF::SharedLock, std::memory_order_seq_cst);
-			while (spLock.load(std::memory_order_seq_cst))
-			{
-				(*flags)[idx].flag.store(CFF::PrepareLock, std::memory_order_seq_cst);
-				for (volatile int f = 0; spLock.load(std::memory_order_seq_cst); ++f)
-					;
-				(*flags)[idx].flag.store(CFF::SharedLock, std::memory_order_seq_cst);
-			}
-			*/
-			
-			while (spLock.load(std::memory_order_acquire))
-				;
-			
-			(*flags)[idx].flag.store(CFF::SharedLock, std::memory_order_release);
-
-			// Perform the SharedLock
+			NodeReaders& nr = *nodeReaders[alloc::ThreadRegistry::node()];
+			nr.flags()[idx].flag.store(CFF::SharedLock, std::memory_order_seq_cst);
+			nr.summary.count.fetch_add(1, std::memory_order_seq_cst);
 		}
+		else
+			flags[idx].flag.store(CFF::SharedLock, std::memory_order_seq_cst);
+	}
 
-		// Thread is not registered, we must acquire spill lock
+	void retract(size_t idx) noexcept
+	{
+		if (idx < slots)
+			leaveFlag(idx);
 		else
+			leaveShard(shardFor(idx).count);
+	}
+
+	// Announce ourselves and then check the gate,
+	// a writer does the opposite so one of us always sees the other
+	bool tryEnterShared(size_t idx)
+	{
+		announce(idx);
+		if (gate().load(std::memory_order_seq_cst) == Unlocked)
+			return true;
+
+		retract(idx);
+		return false;
+	}
+
+	bool lockShared(const Deadline& deadline)
+	{
+		const size_t idx = alloc::ThreadRegistry::index();
+		if (tryEnterShared(idx))
+			return true;
+
+		// A writer has (or is getting) the lock, back off until it's done.
+		// Under PhaseFair we stay counted in blockedReaders until we're in,
+		// which keeps the next writer out
+		if constexpr (phaseFair)
+			blockedReaders.fetch_add(1, std::memory_order_acq_rel);
+
+		bool entered = false;
+		do
+			lockStats.readerRetries.fetch_add(1, std::memory_order_relaxed);
+		while (waitForGate(deadline) && !(entered = tryEnterShared(idx)));
+
+		if constexpr (phaseFair)
+			if (blockedReaders.fetch_sub(1, std::memory_order_acq_rel) == 1)
+				alloc::futexWakeAll(blockedReaders);
+
+		return entered;
+	}
+
+	// Readers raise their flag (or count) before checking the spill lock,
+	// so while we hold it any reader we don't see here will back off
+	bool readersPresent() const noexcept
+	{
+		// A reader raises its flag before adding to the summary,
+		// so a node with a summary of 0 can be skipped
+		for (int n = 0; n < nodes; ++n)
 		{
-			bool locked = false;
-			while (!spLock.compare_exchange_weak(locked, true, std::memory_order_seq_cst))
-				locked = false;
+			if constexpr (numaAware)
+				if (!nodeReaders[n]->summary.count.load(std::memory_order_seq_cst))
+					continue;
+
+			CFF* nodeFlags = nodeReaders[n]->flags();
+			for (size_t i = 0; i < slots; ++i)
+				if (nodeFlags[i].flag.load(std::memory_order_seq_cst) != CFF::Unlocked)
+					return true;
 		}
+
+		for (int i = 0; i < ImplSharedMutex::OVERFLOW_SHARDS; ++i)
+			if (shards[i].count.load(std::memory_order_seq_cst) & ~Shard::WAITED)
+				return true;
+
+		return false;
 	}
 
-	void unlock_shared()
+	bool drainAll(const Deadline& deadline)
 	{
-		// TODO: Debug safety check here
-		const int idx = getOrSetIndex();
+		for (int n = 0; n < nodes; ++n)
+		{
+			if constexpr (numaAware)
+				if (!nodeReaders[n]->summary.count.load(std::memory_order_seq_cst))
+					continue;
+
+			CFF* nodeFlags = nodeReaders[n]->flags();
+			for (size_t i = 0; i < slots; ++i)
+				if (!drain(nodeFlags[i].flag, deadline))
+					return false;
+		}
 
-		if (idx >= ThreadRegister::Registered)
-			(*flags)[idx].flag.store(CFF::Registered, std::memory_order_release);
+		for (int i = 0; i < ImplSharedMutex::OVERFLOW_SHARDS; ++i)
+			if (!drainShard(shards[i].count, deadline))
+				return false;
 
-		else
-			spLock.store(false, std::memory_order_release);
+		return true;
 	}
 
-	void lock()
+	bool lockExclusive(const Deadline& deadline)
 	{
-		// Spin until we acquire the spill lock
-		bool locked = false;
-		while (!spLock.compare_exchange_weak(locked, true, std::memory_order_acquire))
-			locked = false;
+		// Uncontended, nothing worth recording
+		if (try_lock())
+			return true;
 
-		// Now spin until all other threads are non-shared locked
-		for (CFF& f : *flags)
-			while (f.flag.load(std::memory_order_seq_cst) == CFF::SharedLock)
-				;
+		const auto start = Clock::now();
+
+		bool locked = lockWord(upgradeLock, deadline);
+		if (locked && !(locked = lockWriter(deadline)))
+			release(upgradeLock);
+
+		if (locked)
+		{
+			const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start);
+			lockStats.recordWriterWait(ns.count());
+		}
+		return locked;
 	}
 
-	void unlock()
+	// The rest of an exclusive lock, once we hold upgradeLock
+	bool tryLockWriter()
 	{
-		// TODO: Debug safety check here
-		spLock.store(false, std::memory_order_seq_cst);
+		if constexpr (phaseFair)
+			if (blockedReaders.load(std::memory_order_acquire))
+				return false;
+
+		if (!tryLockWord(spLock))
+			return false;
+
+		if (shutOutReaders())
+			return true;
+
+		release(spLock);
+		return false;
 	}
 
-	bool try_lock_shared()
+	bool lockWriter(const Deadline& deadline)
 	{
-		bool locked = false;
-		const int idx = registerThread();
-		if (idx >= ThreadRegister::Registered)
+		return tryLockWriter() || lockWriterSlow(deadline);
+	}
+
+	bool lockWriterSlow(const Deadline& deadline)
+	{
+		if constexpr (readerPref)
 		{
-			if (spLock.load(std::memory_order_acquire)) // TODO: I don't think this is entirely safe!
+			// Readers don't look at the spill lock here. Shut them out
+			// only once none are in, otherwise let them (and any new ones) keep going
+			if (!lockWord(spLock, deadline))
 				return false;
 
-			(*flags)[idx].flag.store(CFF::SharedLock, std::memory_order_release);
+			while (!shutOutReaders())
+				if (!drainAll(deadline))
+				{
+					release(spLock);
+					return false;
+				}
 			return true;
 		}
 		else
-			spLock.compare_exchange_strong(locked, true, std::memory_order_seq_cst);
+		{
+			if constexpr (phaseFair)
+				if (!waitForBlockedReaders(deadline))
+					return false;
 
-		return locked;
+			if (!lockWord(spLock, deadline))
+				return false;
+
+			// Now wait until all other threads are non-shared locked
+			if (drainAll(deadline))
+				return true;
+
+			release(spLock);
+			return false;
+		}
 	}
 
-	template<class Rep, class Period>
-	bool try_lock_shared_for(const std::chrono::duration<Rep, Period>& relTime)
+	// PhaseFair writer side, let the readers the last writer held up in first
+	bool waitForBlockedReaders(const Deadline& deadline)
 	{
-		// TODO:
-		return false;
-	}
+		if (!blockedReaders.load(std::memory_order_acquire))
+			return true;
 
+		WaitTimer timer{ lockStats };
+		for (int i = 0; i < ImplSharedMutex::SPIN_LIMIT; ++i)
+		{
+			alloc::cpuRelax();
+			if (!blockedReaders.load(std::memory_order_acquire))
+				return true;
+		}
 
-private:
+		for (;;)
+		{
+			const int blocked = blockedReaders.load(std::memory_order_acquire);
+			if (!blocked)
+				return true;
 
-	// Keeps track of the threads index if it has one
-	// and manages the threads removal from the array on destruction
-	struct ThreadRegister
+			if (!timer.park(blockedReaders, blocked, deadline))
+				return false;
+		}
+	}
+
+	Shard& shardFor(size_t idx) noexcept
 	{
-		enum Status
+		return shards[(idx - slots) % ImplSharedMutex::OVERFLOW_SHARDS];
+	}
+
+	void leaveShard(std::atomic<int>& count) noexcept
+	{
+		// Last reader out wakes the parked writer
+		if (count.fetch_sub(1, std::memory_order_release) == (Shard::WAITED | 1))
 		{
-			Unregistered = -2,
-			PrepareToRegister,
-			Registered,
-		};
-
-		ThreadRegister(SharedMutex& cont) :
-			index{	Status::Unregistered },
-			cont{	cont }
-		{}
-
-		ThreadRegister(ThreadRegister&& other) noexcept :
-			index{	std::move(other.index) },
-			cont{	other.cont }
+			int waited = Shard::WAITED;
+			count.compare_exchange_strong(waited, 0, std::memory_order_relaxed);
+			alloc::futexWakeOne(count);
+		}
+	}
+
+	void leaveFlag(size_t idx) noexcept
+	{
+		if constexpr (numaAware)
 		{
-			other.index = Status::Unregistered;
+			NodeReaders& nr = *nodeReaders[alloc::ThreadRegistry::node()];
+			lowerFlag(nr.flags()[idx].flag);
+			nr.summary.count.fetch_sub(1, std::memory_order_release);
 		}
+		else
+			lowerFlag(flags[idx].flag);
+	}
 
-		ThreadRegister(const ThreadRegister& other)				= delete;
-		ThreadRegister& operator=(const ThreadRegister& other)	= delete;
-		ThreadRegister& operator=(ThreadRegister&& other)		= delete;
+	void lowerFlag(std::atomic<int>& flag) noexcept
+	{
+		if (flag.exchange(CFF::Unlocked, std::memory_order_release) == CFF::SharedLockWaited)
+			alloc::futexWakeOne(flag);
+	}
 
-		// Unregister the thread and reset it's ID on thread's dtor call
-		// (acheived through static thread_local variable)
-		~ThreadRegister()
+	// Plain futex mutex (Drepper's "Futexes Are Tricky", mutex 3) with a spin phase.
+	// seq_cst as the writer's lock is one half of the Dekker with the reader flags
+	bool tryLockWord(std::atomic<int>& word) noexcept
+	{
+		int state = Unlocked;
+		return word.compare_exchange_strong(state, Locked, std::memory_order_seq_cst);
+	}
+
+	bool lockWord(std::atomic<int>& word, const Deadline& deadline)
+	{
+		if (tryLockWord(word))
+			return true;
+
+		int state;
+		WaitTimer timer{ lockStats };
+		for (int i = 0; i < ImplSharedMutex::SPIN_LIMIT; ++i)
 		{
-			if (index >= Status::Registered)
-			{
-				auto& cf	= (*cont.flags)[index];
-				cf.id		= defaultThreadId;
+			alloc::cpuRelax();
+			state = Unlocked;
+			if (word.load(std::memory_order_relaxed) == Unlocked
+				&& word.compare_exchange_weak(state, Locked, std::memory_order_seq_cst))
+				return true;
+		}
 
-				int free = CFF::Registered;
-				while (!cf.flag.compare_exchange_weak(free, CFF::Unregistered, std::memory_order_release))
-					free = CFF::Registered;
-			}
+		// From here on we don't know whether anyone else is parked,
+		// so we have to take the lock as Contended. Timing out
+		// leaves it Contended, which only costs the owner a spurious wake
+		state = word.exchange(Contended, std::memory_order_seq_cst);
+		while (state != Unlocked)
+		{
+			if (!timer.park(word, Contended, deadline))
+				return false;
+			state = word.exchange(Contended, std::memory_order_seq_cst);
 		}
+		return true;
+	}
 
-		int				index;
-		SharedMutex&	cont;
-	};
+	// Let readers back in, upgradeLock is still held
+	void openGate() noexcept
+	{
+		if constexpr (readerPref)
+			release(writerIn);
+		release(spLock);
+	}
+
+	// Unlock spLock, upgradeLock or writerIn and wake anyone parked on it
+	void release(std::atomic<int>& word) noexcept
+	{
+		if (word.exchange(Unlocked, std::memory_order_release) == Contended)
+			alloc::futexWakeAll(word);
+	}
+
+	// What readers check before going in
+	std::atomic<int>& gate() noexcept
+	{
+		if constexpr (readerPref)
+			return writerIn;
+		else
+			return spLock;
+	}
 
+	// With the spill lock held, close the gate to readers if none are in.
+	// Outside of ReaderPreferring the spill lock is the gate
+	bool shutOutReaders() noexcept
+	{
+		if constexpr (readerPref)
+			writerIn.store(Locked, std::memory_order_seq_cst);
 
-	// Find the index of this thread in our array
-	// If it's never been registered, prepare it to 
-	// be or set it's registered index
-	//
-	// TODO: Use a sorted vector or a fast hash map
-	int getOrSetIndex(int idx = ThreadRegister::Unregistered)
+		if (!readersPresent())
+			return true;
+
+		if constexpr (readerPref)
+			release(writerIn);
+		return false;
+	}
+
+	// Reader side, wait until the gate is open (without taking it)
+	bool waitForGate(const Deadline& deadline)
 	{
-		using ObjectMap = std::vector<std::pair<void*, ThreadRegister>>;
-		static thread_local ObjectMap tmap;
+		auto& word = gate();
+
+		WaitTimer timer{ lockStats };
+		for (int i = 0; i < ImplSharedMutex::SPIN_LIMIT; ++i)
+		{
+			if (word.load(std::memory_order_relaxed) == Unlocked)
+				return true;
+			alloc::cpuRelax();
+		}
 
-		// TODO: Possibly? Use binary search on sorted vec if size is greater than (?)
-		auto find = std::find_if(std::begin(tmap), std::end(tmap), [&](const auto& it)
+		for (;;)
 		{
-			return it.first == this;
-		});
+			int state = word.load(std::memory_order_relaxed);
+			if (state == Unlocked)
+				return true;
+
+			// Make sure the unlocker knows to wake us
+			if (state == Locked && !word.compare_exchange_weak(state, Contended, std::memory_order_relaxed))
+				continue;
+
+			if (!timer.park(word, Contended, deadline))
+				return false;
+		}
+	}
+
+	// Writer side, wait until a reader flag is lowered
+	bool drain(std::atomic<int>& flag, const Deadline& deadline)
+	{
+		if (flag.load(std::memory_order_seq_cst) == CFF::Unlocked)
+			return true;
 
-		if (find == std::end(tmap))
+		WaitTimer timer{ lockStats };
+		for (int i = 0; i < ImplSharedMutex::SPIN_LIMIT; ++i)
 		{
-			tmap.emplace_back(this, *this);
-			return ThreadRegister::PrepareToRegister;
+			alloc::cpuRelax();
+			if (flag.load(std::memory_order_acquire) == CFF::Unlocked)
+				return true;
 		}
-		else if(idx >= ThreadRegister::Registered)
-			find->second.index = idx;
 
-		return find->second.index;
+		for (;;)
+		{
+			int state = flag.load(std::memory_order_acquire);
+			if (state == CFF::Unlocked)
+				return true;
+
+			if (state == CFF::SharedLock && !flag.compare_exchange_weak(state, CFF::SharedLockWaited, std::memory_order_acquire))
+				continue;
+
+			if (!timer.park(flag, CFF::SharedLockWaited, deadline))
+				return false;
+		}
 	}
 
-	// Check if this thread has been registered before,
-	// If not, set it up for registration
-	//
-	// TODO: Doesn't handle cases where we have more threads than is possible
-	int registerThread()
+	// Writer side, wait until a shard's reader count drops to 0
+	bool drainShard(std::atomic<int>& count, const Deadline& deadline)
 	{
-		int idx = getOrSetIndex();
+		if ((count.load(std::memory_order_seq_cst) & ~Shard::WAITED) == 0)
+			return true;
 
-		// Thread has never been registered (try to once)
-		if (idx == ThreadRegister::PrepareToRegister)
-			for (int i = 0; i < threads; ++i)
-			{
-				auto& f		= (*flags)[i];
-				int free	= CFF::Unregistered;
-				if (f.flag.compare_exchange_strong(free, CFF::Registered, std::memory_order_release))
-				{
-					idx		= i;
-					f.id	= std::this_thread::get_id();
-					getOrSetIndex(idx);
-					break;
-				}
-			}
+		WaitTimer timer{ lockStats };
+		for (int i = 0; i < ImplSharedMutex::SPIN_LIMIT; ++i)
+		{
+			alloc::cpuRelax();
+			if ((count.load(std::memory_order_acquire) & ~Shard::WAITED) == 0)
+				return true;
+		}
+
+		for (;;)
+		{
+			int state = count.load(std::memory_order_acquire);
+			if ((state & ~Shard::WAITED) == 0)
+				return true;
+
+			if (!(state & Shard::WAITED) && !count.compare_exchange_weak(state, state | Shard::WAITED, std::memory_order_acquire))
+				continue;
 
-		return idx;
+			if (!timer.park(count, state | Shard::WAITED, deadline))
+				return false;
+		}
 	}
 };
 
@@ -58,12 +58,29 @@ public:
 		return SlabMemImpl::Interface::allocate<T>(count);
 	}
 
+	// Allocate space for at least count objects of type T. 
+	// The count returned includes any room left over in the
+	// cache's block size, and is what should be passed to deallocate
+	template<class T = Type>
+	static allocation_result<T> allocate_at_least(size_type count = 1)
+	{
+		return SlabMemImpl::Interface::allocate_at_least<T>(count);
+	}
+
 	template<class T>
 	static void deallocate(T* ptr, size_type n)
 	{
 		SlabMemImpl::Interface::deallocate(ptr, n);
 	}
 
+	// Number of usable bytes in the block ptr points to
+	// (0 if ptr wasn't allocated from one of the caches)
+	template<class T>
+	static size_type usable_size(T* ptr)
+	{
+		return SlabMemImpl::Interface::usable_size(ptr);
+	}
+
 	// Add a dynamic cache that stores count 
 	// number of blockSize memory chunks
 	static void addCache(size_type blockSize, size_type count)
@@ -138,6 +138,14 @@ struct Cache
 		return { &store, std::end(store) };
 	}
 
+	// Does one of our Slabs hold the memory ptr points to?
+	template<class P>
+	bool owns(P* ptr)
+	{
+		return searchStore(slabsFull, ptr).second != std::end(slabsFull)
+			|| searchStore(slabsPart, ptr).second != std::end(slabsPart);
+	}
+
 	template<class T>
 	void deallocate(T* ptr)
 	{
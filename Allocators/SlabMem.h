@@ -140,6 +140,28 @@ struct Interface
 		return reinterpret_cast<T*>(operator new(bytes));
 	}
 
+	template<class T>
+	static alloc::allocation_result<T> allocate_at_least(size_t count)
+	{
+		const auto bytes = count * sizeof(T);
+		for (auto it = std::begin(buckets), 
+			E = std::end(buckets); it != E; ++it)
+			if (it->blockSize >= bytes)
+				return { it->allocate<T>(), it->blockSize / sizeof(T) };
+
+		return { reinterpret_cast<T*>(operator new(bytes)), count };
+	}
+
+	template<class T>
+	static size_type usable_size(T* ptr)
+	{
+		for (auto it = std::begin(buckets), 
+			E = std::end(buckets); it != E; ++it)
+			if (it->owns(ptr))
+				return it->blockSize;
+		return 0;
+	}
+
 	template<class T>
 	static void deallocate(T* ptr, size_type count)
 	{
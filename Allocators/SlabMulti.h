@@ -1,5 +1,7 @@
 #pragma once
 #include "ImplSlabMulti.h"
+#include <algorithm>
+#include <cstring>
 
 namespace ImplSlabMulti
 {
@@ -16,10 +18,14 @@ struct Interface
 
 private:
 
-	using Key			= std::thread::id;
+	// Buckets are keyed by ThreadRegistry index, so when a thread exits
+	// the next thread handed its index picks up its Bucket (and cached Slabs)
+	// instead of them sitting unused. Buckets are only added once per
+	// thread index but looked up on every call, so the map is RCU
+	using Key			= size_t;
 	using Val			= Bucket;
-	using BucketPair	= std::pair<Key, Val>;
-	using MyCont		= alloc::SmpMap<Key, Val, std::vector<BucketPair>>;
+	using MyCont		= alloc::SmpMap<Key, Val, alloc::RcuPolicy>;
+	using BucketPair	= typename MyCont::value_type;
 
 
 	MyCont				buckets;
@@ -27,21 +33,26 @@ private:
 
 public:
 
+	// The Dispatcher has to outlive every Interface, since Caches hand their
+	// Slabs back to it on destruction. Touching it here makes sure it's
+	// constructed first (and so destroyed last) even for static SlabMultis
 	Interface() :
 		buckets{},
 		refCount{ 1 }
-	{}
+	{
+		dispatcher();
+	}
 
 	~Interface()
 	{}
 
 private:
-	void registerThread(std::thread::id id)
+	void registerThread(Key id)
 	{
 		buckets.emplace(id, std::move(Bucket{}));
 	}
 
-	int findCacheIdx(size_type bytes)
+	static constexpr int findCacheIdx(size_type bytes) noexcept
 	{
 		int i = 0;
 		for (const auto& cz : ImplSlabMulti::cacheSizes)
@@ -53,20 +64,20 @@ private:
 		return Bucket::NOT_FOUND;
 	}
 
-public:
-
-	template<class T>
-	T* allocate(size_t count)
+	template<bool zeroed = false>
+	byte* allocateBytes(int idx, size_type bytes)
 	{
-		const auto bytes	= sizeof(T) * count;
-		const auto id		= std::this_thread::get_id();
-		const auto idx		= findCacheIdx(bytes);
+		const auto id = alloc::ThreadRegistry::index();
 
 		auto alloc = [&](auto it, auto& vec) -> byte*
 		{
-			if(it != std::end(vec))
+			if (it == std::end(vec))
+				return nullptr;
+
+			if constexpr (zeroed)
+				return it->second.allocateZeroed(idx, bytes);
+			else
 				return it->second.allocate(idx, bytes);
-			return nullptr;
 		};
 
 		byte* mem = buckets.findDo(id, alloc);
@@ -77,13 +88,91 @@ public:
 			mem = buckets.findDo(id, alloc);
 		}
 
-		return reinterpret_cast<T*>(mem);
+		return mem;
+	}
+
+public:
+
+	template<class T>
+	T* allocate(size_t count)
+	{
+		const auto bytes = sizeof(T) * count;
+		return reinterpret_cast<T*>(allocateBytes(findCacheIdx(bytes), bytes));
+	}
+
+	// calloc like allocate. Blocks from Slabs that have never been
+	// handed out before (and directly mapped large blocks) come 
+	// zeroed from the OS, so only reused blocks get memset
+	template<class T>
+	T* allocate_zeroed(size_t count)
+	{
+		const auto bytes = sizeof(T) * count;
+		return reinterpret_cast<T*>(allocateBytes<true>(findCacheIdx(bytes), bytes));
+	}
+
+	// Same as allocate, but reports how many T's actually fit
+	// in the block we handed out (the rest of the size class)
+	template<class T>
+	alloc::allocation_result<T> allocate_at_least(size_t count)
+	{
+		const auto bytes	= sizeof(T) * count;
+		const auto idx		= findCacheIdx(bytes);
+		byte* mem			= allocateBytes(idx, bytes);
+
+		if (idx >= Bucket::FOUND)
+			count = ImplSlabMulti::cacheSizes[idx] / sizeof(T);
+
+		return { reinterpret_cast<T*>(mem), count };
+	}
+
+	// Succeeds when newCount T's still fit in the size class
+	// ptr was allocated from. On success ptr must be 
+	// deallocated with newCount from then on
+	template<class T>
+	bool try_expand(T*, size_type oldCount, size_type newCount)
+	{
+		const auto idx = findCacheIdx(sizeof(T) * oldCount);
+		return idx >= Bucket::FOUND
+			&& idx == findCacheIdx(sizeof(T) * newCount);
+	}
+
+	template<class T>
+	T* reallocate(T* ptr, size_type oldCount, size_type newCount)
+	{
+		static_assert(std::is_trivially_copyable_v<T>, "reallocate copies bytes, T must be trivially copyable");
+
+		if (try_expand(ptr, oldCount, newCount))
+			return ptr;
+
+		T* mem = allocate<T>(newCount);
+		std::memcpy(mem, ptr, sizeof(T) * std::min(oldCount, newCount));
+		deallocate(ptr, oldCount);
+		return mem;
+	}
+
+	// Size in bytes of the block ptr points to, or 0 if
+	// ptr wasn't handed out by a Slab (large allocations)
+	//
+	// Note: This has to search the Slabs of every thread,
+	// prefer allocate_at_least when the caller can use that instead
+	template<class T>
+	size_type usable_size(T* ptr)
+	{
+		auto* bptr		= reinterpret_cast<byte*>(ptr);
+		size_type size	= 0;
+
+		buckets.iterate([&](BucketPair& pair) -> bool
+		{
+			size = pair.second.usableSize(bptr);
+			return size;
+		});
+		return size;
 	}
 
 	template<class T>
 	void deallocate(T* ptr, size_type n)
 	{
-		const auto id		= std::this_thread::get_id();
+		const auto id		= alloc::ThreadRegistry::index();
 		const auto bytes	= sizeof(T) * n;
 		const auto idx		= findCacheIdx(bytes);
 
@@ -166,8 +255,7 @@ public:
 private:
 	inline void decRef() noexcept
 	{
-		// TODO: Make sure this memory ordering is correct, It's probably not!
-		if (interfacePtr->refCount.fetch_sub(1, std::memory_order_release) < 1)
+		if (interfacePtr->refCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
 			delete interfacePtr;
 	}
 public:
@@ -205,45 +293,124 @@ public:
 
 	SlabMulti& operator=(const SlabMulti& other) noexcept 
 	{
-		if (interfacePtr)
-			decRef();
-		interfacePtr = other.interfacePtr;
+		assign(other.interfacePtr);
+		return *this;
 	}
 
 	template<class U>
 	SlabMulti& operator=(const SlabMulti<U>& other) noexcept
 	{
-		if (interfacePtr)
-			decRef();
-		interfacePtr = other.interfacePtr;
+		assign(other.interfacePtr);
+		return *this;
 	}
 
 	SlabMulti& operator=(SlabMulti&& other) noexcept
 	{
-		if (interfacePtr)
-			decRef();
-		interfacePtr = other.interfacePtr;
+		assign(other.interfacePtr);
+		return *this;
 	}
 
 	template<class U>
 	SlabMulti& operator=(SlabMulti<U>&& other) noexcept
 	{
-		if (interfacePtr)
-			decRef();
-		interfacePtr = other.interfacePtr;
+		assign(other.interfacePtr);
+		return *this;
 	}
 
+private:
+	// Moves share the Interface the same as copies do
+	// (the moved from allocator still has to be usable)
+	void assign(ImplSlabMulti::Interface* ptr) noexcept
+	{
+		if (interfacePtr == ptr)
+			return;
+
+		ptr->incRef();
+		decRef();
+		interfacePtr = ptr;
+	}
+public:
+
 	template<class T = Type>
 	T* allocate(size_t count = 1)
 	{
 		return interfacePtr->allocate<T>(count);
 	}
 
+	// Same as allocate except the memory is zero filled.
+	// Skips the memset when the memory is fresh from the OS
+	template<class T = Type>
+	T* allocate_zeroed(size_t count = 1)
+	{
+		return interfacePtr->allocate_zeroed<T>(count);
+	}
+
+	// Allocate room for at least count T's. The returned count 
+	// includes the slack left in the size class and can be passed
+	// back to deallocate as n
+	template<class T = Type>
+	allocation_result<T> allocate_at_least(size_t count = 1)
+	{
+		return interfacePtr->allocate_at_least<T>(count);
+	}
+
 	template<class T = Type>
 	void deallocate(T* ptr, size_type n)
 	{
 		interfacePtr->deallocate(ptr, n);
 	}
+
+	// Grow (or shrink) the block ptr points to without moving it.
+	// Only succeeds if newCount still fits in ptr's size class
+	template<class T = Type>
+	bool try_expand(T* ptr, size_type oldCount, size_type newCount)
+	{
+		return interfacePtr->try_expand(ptr, oldCount, newCount);
+	}
+
+	// Resize the block, only copying the contents if
+	// try_expand fails. T must be trivially copyable
+	template<class T = Type>
+	T* reallocate(T* ptr, size_type oldCount, size_type newCount)
+	{
+		return interfacePtr->reallocate(ptr, oldCount, newCount);
+	}
+
+	// Returns the number of usable bytes in the block ptr points to
+	// (0 if the block didn't come from a Slab)
+	template<class T = Type>
+	size_type usable_size(T* ptr)
+	{
+		return interfacePtr->usable_size(ptr);
+	}
+
+	// Settings for the superblock pool shared by all SlabMulti's.
+	// With prefault on new superblocks are faulted in (and with lockPages pinned)
+	// when they're mapped rather than when a thread first touches them
+	static void setPrefault(bool prefault, bool lockPages = false)
+	{
+		ImplSlabMulti::dispatcher().setPrefault(prefault, lockPages);
+	}
+
+	// Keep at least watermark superblocks of fresh (and if set, prefaulted) Slabs 
+	// ready using a low priority background thread, so allocating
+	// threads don't have to wait on the OS
+	static void startRefiller(int watermark)
+	{
+		ImplSlabMulti::dispatcher().startRefiller(watermark);
+	}
+
+	static void stopRefiller()
+	{
+		ImplSlabMulti::dispatcher().stopRefiller();
+	}
+
+	// Hand out free Slabs lowest address first so each thread's Slabs
+	// stay packed in as few superblocks as possible. Can be toggled at any time
+	static void setAddressOrdered(bool addressOrdered)
+	{
+		ImplSlabMulti::dispatcher().setAddressOrdered(addressOrdered);
+	}
 };
 
 } // End alloc::
\ No newline at end of file
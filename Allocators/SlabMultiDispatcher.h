@@ -1,7 +1,12 @@
 #pragma once
+#include <array>
 #include <vector>
+#include <map>
+#include <set>
 #include <mutex>
-#include <numeric>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
 #include "AllocHelpers.h"
 
 namespace ImplSlabMulti
@@ -9,107 +14,498 @@ namespace ImplSlabMulti
 constexpr auto SUPERBLOCK_SIZE	= 1 << 20;
 constexpr auto SLAB_SIZE		= 1 << 14;
 constexpr auto MAX_SLAB_BLOCKS	= 65535;								// Max number of memory blocks a Slab can be divided into 
+constexpr auto MIN_SLAB_BLOCKS	= 32;									// Min number of memory blocks per Slab (larger classes use multi SLAB_SIZE spans)
 constexpr auto NUM_CACHES		= 8;
 constexpr auto SMALLEST_CACHE	= 64;
 constexpr auto LARGEST_CACHE	= SMALLEST_CACHE << (NUM_CACHES - 1);
 constexpr auto INIT_SUPERBLOCKS = 4;									// Number of Superblocks allocated per request
-
-static_assert(LARGEST_CACHE <= SLAB_SIZE);
+constexpr auto DIRECT_MAP_SIZE	= 1 << 18;								// Allocations at least this large are mapped straight from the OS
 
 using byte			= alloc::byte;
 using IndexSizeT	= alloc::FindSizeT<MAX_SLAB_BLOCKS>::size_type;
 
-auto buildCaches = [](int startSz)
+// Built at compile time so nothing runs during static initialization
+constexpr auto buildCaches = []()
 {
-	std::vector<int> v;
-	for (int i = startSz; i <= LARGEST_CACHE; i <<= 1)
-		v.emplace_back(i);
-	return v;
+	std::array<int, NUM_CACHES> a{};
+	for (int i = 0; i < NUM_CACHES; ++i)
+		a[i] = SMALLEST_CACHE << i;
+	return a;
 };
 
-auto buildBlocksPer = [](const std::vector<int>& cacheSizes)
+// The larger size classes get Slabs that span several SLAB_SIZE
+// blocks so each Slab still holds at least MIN_SLAB_BLOCKS blocks
+constexpr auto buildSlabsPerSpan = []()
 {
-	std::vector<int> v;
-	for (const auto s : cacheSizes)
-		v.emplace_back(SLAB_SIZE / s);
-	return v;
+	std::array<int, NUM_CACHES> a{};
+	for (int i = 0; i < NUM_CACHES; ++i)
+	{
+		a[i] = 1;
+		while (SLAB_SIZE * a[i] / (SMALLEST_CACHE << i) < MIN_SLAB_BLOCKS)
+			a[i] <<= 1;
+	}
+	return a;
 };
 
-const std::vector<int> cacheSizes		= buildCaches(SMALLEST_CACHE);
-const std::vector<int> blocksPerSlab	= buildBlocksPer(cacheSizes);
+constexpr std::array<int, NUM_CACHES> cacheSizes	= buildCaches();
+constexpr std::array<int, NUM_CACHES> slabsPerSpan	= buildSlabsPerSpan();
+
+// log2 of slabsPerSpan, the dispatcher keeps a pool per order
+constexpr auto buildSpanOrders = []()
+{
+	std::array<int, NUM_CACHES> a{};
+	for (int i = 0; i < NUM_CACHES; ++i)
+		while ((1 << a[i]) < slabsPerSpan[i])
+			++a[i];
+	return a;
+};
+
+constexpr auto buildBlocksPer = []()
+{
+	std::array<int, NUM_CACHES> a{};
+	for (int i = 0; i < NUM_CACHES; ++i)
+		a[i] = SLAB_SIZE * slabsPerSpan[i] / cacheSizes[i];
+	return a;
+};
+
+constexpr std::array<int, NUM_CACHES> spanOrders	= buildSpanOrders();
+constexpr std::array<int, NUM_CACHES> blocksPerSlab	= buildBlocksPer();
+constexpr auto NUM_SPAN_ORDERS						= spanOrders.back() + 1;
+
+static_assert(SLAB_SIZE * slabsPerSpan.back() <= SUPERBLOCK_SIZE);
+static_assert(blocksPerSlab.front() <= MAX_SLAB_BLOCKS);
+static_assert(cacheSizes.back() == LARGEST_CACHE);
+static_assert(LARGEST_CACHE <= SLAB_SIZE * slabsPerSpan.back());
+
+// Lock free (Treiber) stack of Slab sized blocks. Blocks in
+// the stack are unused so the link to the next block is 
+// stored in the block itself. The head is tagged to avoid ABA
+class BlockStack
+{
+	using TaggedPtr = alloc::TaggedPtr;
+
+	std::atomic<TaggedPtr::value_type>	head;
+	std::atomic<size_t>					count;
+
+	static byte*& next(byte* block) noexcept { return *reinterpret_cast<byte**>(block); }
+
+public:
+
+	static void link(byte* block, byte* nxt) noexcept { next(block) = nxt; }
+
+	// Zero the link word (so fresh blocks are all zeros again), returns what it held
+	static byte* clearLink(byte* block) noexcept
+	{
+		byte* nxt	= next(block);
+		next(block) = nullptr;
+		return nxt;
+	}
+
+	BlockStack() noexcept :
+		head{	0 },
+		count{	0 }
+	{}
+
+	// Push a chain of n blocks already linked from first to last
+	void push(byte* first, byte* last, size_t n) noexcept
+	{
+		count.fetch_add(n, std::memory_order_relaxed);
+
+		auto old = head.load(std::memory_order_relaxed);
+		do
+		{
+			next(last) = TaggedPtr{ old }.ptr<byte>();
+		} while (!head.compare_exchange_weak(old, TaggedPtr{ first, TaggedPtr{ old }.tag() + 1 }.raw(),
+			std::memory_order_release, std::memory_order_relaxed));
+	}
+
+	void push(byte* block) noexcept
+	{
+		push(block, block, 1);
+	}
+
+	byte* pop() noexcept
+	{
+		auto old = head.load(std::memory_order_acquire);
+		for (;;)
+		{
+			TaggedPtr top{ old };
+			byte* block = top.ptr<byte>();
+			if (!block)
+				return nullptr;
+
+			// If another thread pops block first this may read garbage (the memory 
+			// is never unmapped so it's a safe read), but then the tag will have 
+			// changed and our CAS fails
+			byte* nxt = next(block);
+			if (head.compare_exchange_weak(old, TaggedPtr{ nxt, top.tag() + 1 }.raw(),
+				std::memory_order_acquire, std::memory_order_acquire))
+			{
+				count.fetch_sub(1, std::memory_order_relaxed);
+				return block;
+			}
+		}
+	}
+
+	size_t size() const noexcept { return count.load(std::memory_order_relaxed); }
+};
 
 struct GlobalDispatch
 {
-	using FreeIndicies = std::vector<std::pair<size_t, std::vector<IndexSizeT>>>;
+	static constexpr int SLABS_PER_SUPERBLOCK = SUPERBLOCK_SIZE / SLAB_SIZE;
 
+	static_assert(SLABS_PER_SUPERBLOCK <= 64, "A superblock's Slabs must fit in a uint64_t bitmap");
+
+	// No memory is requested until the first Slab is
 	GlobalDispatch() :
-		mutex{},
 		blocks{},
+		fresh{},
 		totalSBlocks{ 0 },
-		availible{ buildIndicies() }
+		spans{},
+		ordered{ false },
+		orderedMutex{},
+		superblocks{},
+		withFree{},
+		orderedCount{ 0 },
+		orderedFresh{ 0 },
+		prefault{ false },
+		lockPages{ false },
+		watermark{ 0 },
+		stopRefill{ false },
+		refillMutex{},
+		refillCv{},
+		refiller{}
+	{}
+
+	~GlobalDispatch()
 	{
-		requestMem(INIT_SUPERBLOCKS);
+		stopRefiller();
 	}
 
-	byte* getBlock()
+	// Returns a Slab sized block of memory and whether
+	// it's known to be zero filled (it's never been handed out).
+	//
+	// Stack mode:		Blocks that have been used before are handed out first
+	//					as they're more likely to still be in cache
+	// Ordered mode:	The lowest addressed free block is handed out
+	//
+	// Order > 0 returns a span of 2^order contiguous Slab sized blocks
+	std::pair<byte*, bool> getBlock(int order = 0)
 	{
-		std::lock_guard lock(mutex);
-		if (blocks.empty())
-			requestMem(INIT_SUPERBLOCKS);
-		byte* mem = blocks.back();
-		blocks.pop_back();
-		return mem;
+		if (order)
+			return getSpan(order);
+
+		std::pair<byte*, bool> block{ nullptr, false };
+
+		if (ordered.load(std::memory_order_relaxed))
+			block = orderedGet();
+
+		// Blocks pushed by threads that hadn't seen a mode change yet
+		// still end up on the stacks (and vice versa), so always check both
+		if (!block.first)
+		{
+			if (byte* mem = blocks.pop())
+				return { mem, false };
+
+			block = { fresh.pop(), true };
+			if (block.first)
+				BlockStack::clearLink(block.first);
+			else if (orderedCount.load(std::memory_order_relaxed))
+				block = orderedGet();
+		}
+
+		if (!block.first)
+			block = { requestMem(INIT_SUPERBLOCKS), true };
+
+		if (block.second 
+			&& watermark.load(std::memory_order_relaxed) 
+			&& belowWatermark())
+		{
+			std::lock_guard lock(refillMutex);
+			refillCv.notify_one();
+		}
+
+		return block;
 	}
 
-	void returnBlock(byte* block)
+	void returnBlock(byte* block, int order = 0)
 	{
-		std::lock_guard lock(mutex);
-		blocks.emplace_back(block);
+		if (order)
+			spans[order].dirty.push(block);
+
+		else if (ordered.load(std::memory_order_relaxed))
+		{
+			std::lock_guard lock(orderedMutex);
+			orderedPut(block, false);
+		}
+		else
+			blocks.push(block);
 	}
 
-	std::vector<IndexSizeT> getIndicies(size_t blockSz) const
+	// In address ordered mode the lowest addressed free Slab is always handed
+	// out, keeping each thread's Slabs packed into as few superblocks (and pages) as possible.
+	// Costs a lock per getBlock/returnBlock. Free Slabs are migrated between
+	// the pools so switching modes at any time is fine
+	void setAddressOrdered(bool addressOrdered)
 	{
-		for (const auto bs : availible)
-			if (bs.first >= blockSz)
-				return bs.second;
+		std::lock_guard lock(orderedMutex);
+		ordered.store(addressOrdered, std::memory_order_relaxed);
+
+		if (addressOrdered)
+		{
+			while (byte* mem = blocks.pop())
+				orderedPut(mem, false);
+
+			while (byte* mem = fresh.pop())
+			{
+				BlockStack::clearLink(mem);
+				orderedPut(mem, true);
+			}
+		}
+		else
+			while (!withFree.empty())
+			{
+				auto[mem, zeroed] = orderedPop();
+				if (zeroed)
+					fresh.push(mem);
+				else
+					blocks.push(mem);
+			}
+	}
 
-		throw std::runtime_error("Incorrect Cache size request");
+	// Map superblocks with all their pages faulted in (and optionally pinned) 
+	// so threads never take a page fault the first time they touch a Slab
+	void setPrefault(bool prefault, bool lockPages = false)
+	{
+		this->prefault.store(prefault, std::memory_order_relaxed);
+		this->lockPages.store(lockPages, std::memory_order_relaxed);
+	}
+
+	// Start a low priority thread that keeps at least watermark superblocks
+	// of fresh Slabs ready. Combine with setPrefault so they're also faulted in
+	void startRefiller(int watermark)
+	{
+		std::lock_guard lock(refillMutex);
+		this->watermark.store(watermark, std::memory_order_relaxed);
+		if (refiller.joinable())
+		{
+			refillCv.notify_one();
+			return;
+		}
+
+		stopRefill	= false;
+		refiller	= std::thread{ &GlobalDispatch::refill, this };
+	}
+
+	void stopRefiller()
+	{
+		{
+			std::lock_guard lock(refillMutex);
+			stopRefill = true;
+			watermark.store(0, std::memory_order_relaxed);
+		}
+		refillCv.notify_one();
+
+		if (refiller.joinable())
+			refiller.join();
+	}
+
+	// Number of never used Slabs ready to be handed out
+	size_t freshBlocks() const noexcept
+	{
+		return fresh.size() + orderedFresh.load(std::memory_order_relaxed);
 	}
 
 private:
 
-	void requestMem(int sblocks = 1)
+	// Free and zero filled Slabs of a superblock, bit i is the i'th Slab.
+	// Only used by the address ordered pool
+	struct SuperBlock
+	{
+		uint64_t free	= 0;
+		uint64_t zeroed = 0;
+	};
+
+	bool belowWatermark() const noexcept
+	{
+		return freshBlocks() < static_cast<size_t>(watermark.load(std::memory_order_relaxed)) * SLABS_PER_SUPERBLOCK;
+	}
+
+	// Must hold orderedMutex
+	void orderedPut(byte* block, bool zeroed)
+	{
+		auto it				= std::prev(superblocks.upper_bound(block));
+		const uint64_t bit	= uint64_t{ 1 } << ((block - it->first) / SLAB_SIZE);
+
+		it->second.free |= bit;
+		if (zeroed)
+		{
+			it->second.zeroed |= bit;
+			orderedFresh.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		orderedCount.fetch_add(1, std::memory_order_relaxed);
+		withFree.emplace(it->first);
+	}
+
+	// Must hold orderedMutex and withFree must not be empty
+	std::pair<byte*, bool> orderedPop()
+	{
+		auto sit			= std::begin(withFree);
+		auto& sb			= superblocks.find(*sit)->second;
+		const int idx		= alloc::lowestSetBit(sb.free);
+		const uint64_t bit	= uint64_t{ 1 } << idx;
+		const bool zeroed	= sb.zeroed & bit;
+
+		sb.free		&= ~bit;
+		sb.zeroed	&= ~bit;
+		if (zeroed)
+			orderedFresh.fetch_sub(1, std::memory_order_relaxed);
+		orderedCount.fetch_sub(1, std::memory_order_relaxed);
+
+		byte* mem = *sit + idx * SLAB_SIZE;
+		if (!sb.free)
+			withFree.erase(sit);
+
+		return { mem, zeroed };
+	}
+
+	std::pair<byte*, bool> orderedGet()
+	{
+		std::lock_guard lock(orderedMutex);
+		if (withFree.empty())
+			return { nullptr, false };
+		return orderedPop();
+	}
+
+	// Map a superblock and register it so its Slabs
+	// can be placed in the address ordered pool
+	byte* mapSuperblock()
+	{
+		// Memory straight from the OS is zero filled
+		byte* mem = alloc::osAlloc(SUPERBLOCK_SIZE, 
+			prefault.load(std::memory_order_relaxed), 
+			lockPages.load(std::memory_order_relaxed));
+
+		{
+			std::lock_guard lock(orderedMutex);
+			superblocks.emplace(mem, SuperBlock{});
+		}
+		totalSBlocks.fetch_add(1, std::memory_order_relaxed);
+		return mem;
+	}
+
+	// Give the fresh Slabs of a superblock to whichever pool is active.
+	// first is the index of the first Slab to hand over
+	void addFresh(byte* mem, int first = 0)
+	{
+		if (ordered.load(std::memory_order_relaxed))
+		{
+			std::lock_guard lock(orderedMutex);
+			for (int i = first; i < SLABS_PER_SUPERBLOCK; ++i)
+				orderedPut(mem + i * SLAB_SIZE, true);
+			return;
+		}
+
+		// Link the Slabs lowest address first and push them all at once
+		for (int i = first; i < SLABS_PER_SUPERBLOCK - 1; ++i)
+			BlockStack::link(mem + i * SLAB_SIZE, mem + (i + 1) * SLAB_SIZE);
+
+		fresh.push(mem + first * SLAB_SIZE, mem + (SLABS_PER_SUPERBLOCK - 1) * SLAB_SIZE, 
+			static_cast<size_t>(SLABS_PER_SUPERBLOCK - first));
+	}
+
+	// Spans aren't address ordered, each order gets its own
+	// pools and carves whole superblocks into spans when empty
+	std::pair<byte*, bool> getSpan(int order)
 	{
-		for (int i = 0; i < sblocks; ++i)
+		auto& pool = spans[order];
+		if (byte* mem = pool.dirty.pop())
+			return { mem, false };
+
+		byte* mem = pool.fresh.pop();
+		if (mem)
+		{
+			BlockStack::clearLink(mem);
+			return { mem, true };
+		}
+
+		const int spanBytes = SLAB_SIZE << order;
+		const int count		= SUPERBLOCK_SIZE / spanBytes;
+
+		mem = mapSuperblock();
+		if (count > 1)
 		{
-			byte* mem = reinterpret_cast<byte*>(operator new(SUPERBLOCK_SIZE));
+			for (int i = 1; i < count - 1; ++i)
+				BlockStack::link(mem + i * spanBytes, mem + (i + 1) * spanBytes);
 
-			for (int idx = 0; idx < SUPERBLOCK_SIZE; idx += SLAB_SIZE)
-				blocks.emplace_back(mem + idx);
+			pool.fresh.push(mem + spanBytes, mem + (count - 1) * spanBytes, static_cast<size_t>(count - 1));
 		}
-		totalSBlocks += sblocks;
+		return { mem, true };
+	}
+
+	// Hand the first new Slab straight back to the caller
+	byte* requestMem(int sblocks)
+	{
+		byte* mem = mapSuperblock();
+		addFresh(mem, 1);
+
+		for (int i = 1; i < sblocks; ++i)
+			addFresh(mapSuperblock());
+
+		return mem;
 	}
 
-	// Build the vectors of superblock block indices
-	FreeIndicies buildIndicies() const
+	void refill()
 	{
-		int i = 0;
-		FreeIndicies av{ static_cast<size_t>(NUM_CACHES) };
-		for (auto& a : av)
+		alloc::lowerThreadPriority();
+
+		std::unique_lock lock(refillMutex);
+		for (;;)
 		{
-			a.first = cacheSizes[i];
-			a.second.resize(SLAB_SIZE / a.first);
-			std::iota(std::rbegin(a.second), std::rend(a.second), 0);
-			++i;
+			refillCv.wait(lock, [&] { return stopRefill || belowWatermark(); });
+			if (stopRefill)
+				return;
+
+			lock.unlock();
+			addFresh(mapSuperblock());
+			lock.lock();
 		}
-		return av;
 	}
 
-	std::mutex			mutex;
-	std::vector<byte*>	blocks;			// TODO: Should these be kept in address sorted order to improve locality?
-	int					totalSBlocks;
-	const FreeIndicies	availible;
+	BlockStack						blocks;			// Blocks that have been returned (dirty)
+	BlockStack						fresh;			// Blocks that have never been handed out (zero filled apart from the link)
+	std::atomic<int>				totalSBlocks;
+
+	struct SpanPool
+	{
+		BlockStack dirty;
+		BlockStack fresh;
+	};
+
+	std::array<SpanPool, NUM_SPAN_ORDERS> spans;			// Pools of multi Slab spans, index is the order (0 is unused)
+
+	std::atomic<bool>				ordered;		// Hand out the lowest addressed Slab first
+	std::mutex						orderedMutex;
+	std::map<byte*, SuperBlock>		superblocks;	// Every superblock we've mapped
+	std::set<byte*>					withFree;		// Superblocks that have free Slabs in the ordered pool
+	std::atomic<size_t>				orderedCount;
+	std::atomic<size_t>				orderedFresh;
+
+	std::atomic<bool>				prefault;
+	std::atomic<bool>				lockPages;
+	std::atomic<int>				watermark;		// Superblocks of fresh Slabs the refiller keeps ready
+	bool							stopRefill;
+	std::mutex						refillMutex;
+	std::condition_variable			refillCv;
+	std::thread						refiller;
 };
 
-inline GlobalDispatch dispatcher; // TODO: Make this local to the allocator
+// Constructed on first use so programs that never allocate
+// through SlabMulti don't pay for it at startup
+inline GlobalDispatch& dispatcher() // TODO: Make this local to the allocator
+{
+	static GlobalDispatch d;
+	return d;
+}
 }
\ No newline at end of file
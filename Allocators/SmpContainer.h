@@ -1,11 +1,24 @@
 #pragma once
 #include "SharedMutex.h"
+#include "Epoch.h"
 #include <shared_mutex>
 #include <type_traits>
+#include <unordered_map>
+#include <array>
+#include <vector>
+#include <memory>
+#include <tuple>
+#include <cstddef>
+
+namespace alloc
+{
+template<class Type>
+class SlabMulti;
+}
 
 namespace ImplSmpContainer
 {
-constexpr int SharedMutexSize	= 8;
+constexpr int SharedMutexSize	= 0; // One reader slot per hardware thread
 
 template<class Container>
 struct SmpContainersBase
@@ -34,128 +47,270 @@ struct SmpContainersBase
 	SharedMutex	mutex;
 };
 
-
-} // End ImplSmpContainer::
-
-namespace alloc
+constexpr int log2(size_t n) noexcept
 {
-
-// TODO: Should be out of alloc:: 
-// 
-// This is a super nifty couple of structs that can tell us
-// if a class has a function called find with(args...) as a signature
-// https://stackoverflow.com/a/16824239/7965931
-
-// Primary template with a static assertion
-// for a meaningful error message
-// if it ever gets instantiated.
-// We could leave it undefined if we didn't care.
-template<typename, typename T>
-struct has_find
+	int bits = 0;
+	while (n >>= 1)
+		++bits;
+	return bits;
+}
+
+// A concurrent hash map split into lock striped shards. Each shard is an
+// std::unordered_map behind its own SharedMutex, so lookups are O(1) and only
+// contend with operations on the same shard. Elements never move once
+// inserted (node based), references to them stay valid until they're erased
+//
+// shardCount must be a power of 2
+template<class K, class V, class Hash, size_t shardCount = 16>
+class StripedMap
 {
-	static_assert(
-		std::integral_constant<T, false>::value,
-		"Second template parameter needs to be of function type.");
-};
+	static_assert(shardCount && !(shardCount & (shardCount - 1)), "shardCount must be a power of 2");
 
-// specialization that does the checking
-template<typename C, typename Ret, typename... Args>
-struct has_find<C, Ret(Args...)>
-{
-private:
-	template<typename T>
-	static constexpr auto check(T*)
-		-> typename
-		std::is_same<
-		decltype(std::declval<T>().find(std::declval<Args>()...)),
-		Ret    // ^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^
-		>::type;  // attempt to call it and see if the return type is correct
-
-	template<typename>
-	static constexpr std::false_type check(...);
 public:
+	using MyContainer	= std::unordered_map<K, V, Hash>;
+	using value_type	= typename MyContainer::value_type;
+	using It			= typename MyContainer::iterator;
+	using SharedMutex	= typename SmpContainersBase<MyContainer>::SharedMutex;
 
-	typedef decltype(check<C>(0)) type;
+private:
 
-	static constexpr bool value = type::value;
-};
+	struct alignas(std::hardware_constructive_interference_size) Shard
+	{
+		MyContainer	cont;
+		SharedMutex	mutex;
+	};
 
-// A wrapper for Map like classes that containers shared/lock protected functions
-template<class K, class V, class Container>
-struct SmpMap 
-	: public ImplSmpContainer::SmpContainersBase<Container>
-{
-	using MyContainer	= Container;
-	using MyBase		= ImplSmpContainer::SmpContainersBase<MyContainer>;
+	std::array<Shard, shardCount>	shards;
+	Hash							hasher;
 
-	using It			= typename MyContainer::iterator;
-	using SharedMutex	= typename MyBase::SharedMutex;
+	// Fibonacci hashing, mixes the top bits so a weak hash (std::hash<size_t> is
+	// the identity) doesn't leave every key in a shard sharing its low bits
+	Shard& shardFor(const K& key)
+	{
+		constexpr int bits = log2(shardCount);
+		if constexpr (bits == 0)
+			return shards[0];
+		else
+		{
+			const uint64_t h = static_cast<uint64_t>(hasher(key)) * 11400714819323198485ull;
+			return shards[static_cast<size_t>(h >> (64 - bits))];
+		}
+	}
 
-	//using typename ImplSmpContainer::has_find;
-	static constexpr auto hasFind = has_find<MyContainer, It(const K&)>::type{};
+public:
 
+	StripedMap() = default;
 
+	// Returns the value stored under key, which is only 
+	// constructed from args if key wasn't already in the map
 	template<class... Args>
-	decltype(auto) emplace(Args&& ...args) // TODO: This should take an iterator, and not be emplace back!
+	V& emplace(const K& key, Args&& ...args)
 	{
-		std::lock_guard lock(this->mutex);
-		return this->cont.emplace_back(std::forward<Args>(args)...);
+		Shard& shard = shardFor(key);
+		std::lock_guard lock(shard.mutex);
+		return shard.cont.try_emplace(key, std::forward<Args>(args)...).first->second;
 	}
 
+	bool erase(const K& key)
+	{
+		Shard& shard = shardFor(key);
+		std::lock_guard lock(shard.mutex);
+		return shard.cont.erase(key);
+	}
+
+	// Calls func(iterator, container) with key's shard shared locked,
+	// iterator is end(container) if key isn't in the map
 	template<class Func>
-	decltype(auto) findDo(const K& k, Func&& func)
+	decltype(auto) findDo(const K& key, Func&& func)
 	{
-		std::shared_lock lock(this->mutex);
-		auto found = find(k, hasFind);
-		return func(found, this->cont);
+		Shard& shard = shardFor(key);
+		std::shared_lock lock(shard.mutex);
+		return func(shard.cont.find(key), shard.cont);
 	}
 
 	// Takes a lambda which if it returns true stops the loop
-	// lambda takes a single argument equal to the basic unit of the Container
+	// lambda takes a single argument equal to the basic unit of the Container.
+	// Shards are locked one at a time, so this isn't a snapshot of the whole map
 	template<class Func>
 	void iterate(Func&& func)
 	{
-		std::shared_lock lock(this->mutex);
-		for (auto& it : this->cont)
+		for (Shard& shard : shards)
 		{
-			auto ret = func(it);
-			if (ret)
-				return;
+			std::shared_lock lock(shard.mutex);
+			for (auto& it : shard.cont)
+				if (func(it))
+					return;
 		}
 	}
 
+	size_t size()
+	{
+		size_t count = 0;
+		for (Shard& shard : shards)
+		{
+			std::shared_lock lock(shard.mutex);
+			count += shard.cont.size();
+		}
+		return count;
+	}
+
+	bool empty()
+	{
+		return !size();
+	}
+};
+
+// Read-copy-update map. Readers find the current snapshot with a single load inside
+// an Epoch::Guard and never wait or write anything shared. Writers are serialized,
+// copy the snapshot, publish the copy and retire the old one through Epoch.
+//
+// Snapshots only hold pointers to the elements, so elements aren't
+// copied on writes and their addresses are stable until they're erased
+template<class K, class V, class Hash>
+class RcuMap
+{
+public:
+	using value_type = std::pair<const K, V>;
+
 private:
+	using Index = std::unordered_map<K, value_type*, Hash>;
 
-	//template<typename std::enable_if<std::is_same<MyContainer, std::vector<std::pair<K, V>>>::value, int>::type = 0>
-	It find(const K& key, std::false_type)
+	// Lets findDo callers treat a snapshot as if it held value_types
+	class It
 	{
-		return std::find_if(std::begin(this->cont), std::end(this->cont), [&](const auto& v)
-		{
-			return v.first == key;
-		});
+		typename Index::const_iterator it;
+
+	public:
+		explicit It(typename Index::const_iterator it) : 
+			it{ it }
+		{}
+
+		value_type& operator*()		const { return *it->second; }
+		value_type* operator->()	const { return it->second; }
+		It&			operator++()		  { ++it; return *this; }
+
+		bool operator==(const It& other) const { return it == other.it; }
+		bool operator!=(const It& other) const { return it != other.it; }
+	};
+
+	struct View
+	{
+		const Index& index;
+
+		It begin()	const { return It{ index.begin() }; }
+		It end()	const { return It{ index.end() }; }
+	};
+
+	std::atomic<Index*>	current;
+	std::mutex			writeMutex;
+
+	void publish(std::unique_ptr<Index> next, Index* old)
+	{
+		current.store(next.release(), std::memory_order_release);
+		alloc::Epoch::retire(old);
+	}
+
+public:
+
+	RcuMap() :
+		current{	new Index{}	},
+		writeMutex{}
+	{}
+
+	~RcuMap()
+	{
+		Index* index = current.load(std::memory_order_relaxed);
+		for (auto& [key, node] : *index)
+			delete node;
+		delete index;
 	}
 
-	It find(const K& key, std::true_type)
+	RcuMap(const RcuMap& other)				= delete;
+	RcuMap& operator=(const RcuMap& other)	= delete;
+
+	template<class... Args>
+	V& emplace(const K& key, Args&& ...args)
 	{
-		return this->cont.find(key);
+		std::lock_guard lock(writeMutex);
+		Index* old	= current.load(std::memory_order_relaxed);
+		auto it		= old->find(key);
+		if (it != std::end(*old))
+			return it->second->second;
+
+		auto node = std::make_unique<value_type>(std::piecewise_construct, 
+			std::forward_as_tuple(key), std::forward_as_tuple(std::forward<Args>(args)...));
+
+		auto next = std::make_unique<Index>(*old);
+		next->emplace(key, node.get());
+		publish(std::move(next), old);
+
+		return node.release()->second;
+	}
+
+	bool erase(const K& key)
+	{
+		std::lock_guard lock(writeMutex);
+		Index* old	= current.load(std::memory_order_relaxed);
+		auto it		= old->find(key);
+		if (it == std::end(*old))
+			return false;
+
+		value_type* node = it->second;
+		auto next = std::make_unique<Index>(*old);
+		next->erase(key);
+		publish(std::move(next), old);
+
+		alloc::Epoch::retire(node);
+		return true;
+	}
+
+	template<class Func>
+	decltype(auto) findDo(const K& key, Func&& func)
+	{
+		alloc::Epoch::Guard guard;
+		const Index& index = *current.load(std::memory_order_acquire);
+
+		View view{ index };
+		return func(It{ index.find(key) }, view);
+	}
+
+	// Walks a single snapshot of the map
+	template<class Func>
+	void iterate(Func&& func)
+	{
+		alloc::Epoch::Guard guard;
+		for (auto& [key, node] : *current.load(std::memory_order_acquire))
+			if (func(*node))
+				return;
+	}
+
+	size_t size()
+	{
+		alloc::Epoch::Guard guard;
+		return current.load(std::memory_order_acquire)->size();
+	}
+
+	bool empty()
+	{
+		return !size();
 	}
 };
 
-template<class Type, template<class> class Container = std::vector>
-class SmpVector : ImplSmpContainer::SmpContainersBase<Container<Type>>
+template<class Type>
+class LockedVector : SmpContainersBase<std::vector<Type>>
 {
 public:
-	using MyContainer	= Container<Type>;
-	using MyBase		= ImplSmpContainer::SmpContainersBase<MyContainer>;
+	using MyContainer	= std::vector<Type>;
+	using MyBase		= SmpContainersBase<MyContainer>;
 
 	using iterator		= typename MyContainer::iterator;
 	using SharedMutex	= typename MyBase::SharedMutex;
 
-	SmpVector() : 
+	LockedVector() : 
 		MyBase{}
 	{}
 
-	SmpVector(SmpVector&& other) noexcept :
+	LockedVector(LockedVector&& other) noexcept :
 		MyBase{ std::move(other) }
 	{}
 
@@ -173,7 +328,281 @@ public:
 		std::lock_guard lock(this->mutex);
 		return this->cont.emplace(it, std::forward<Args>(args)...);
 	}
+
+	// Takes a lambda which if it returns true stops the loop
+	template<class Func>
+	void iterate(Func&& func)
+	{
+		std::shared_lock lock(this->mutex);
+		for (auto& it : this->cont)
+			if (func(it))
+				return;
+	}
+
+	size_t size()
+	{
+		std::shared_lock lock(this->mutex);
+		return this->cont.size();
+	}
+};
+
+// Read-copy-update vector, see RcuMap. Appends copy the
+// snapshot, so this is only for things that are read far more than they're written
+template<class Type>
+class RcuVector
+{
+	using Index = std::vector<Type*>;
+
+	std::atomic<Index*>	current;
+	std::mutex			writeMutex;
+
+public:
+
+	RcuVector() :
+		current{	new Index{}	},
+		writeMutex{}
+	{}
+
+	~RcuVector()
+	{
+		Index* index = current.load(std::memory_order_relaxed);
+		for (Type* elem : *index)
+			delete elem;
+		delete index;
+	}
+
+	RcuVector(const RcuVector& other)				= delete;
+	RcuVector& operator=(const RcuVector& other)	= delete;
+
+	template<class... Args>
+	Type& emplace_back(Args&& ...args)
+	{
+		auto elem = std::make_unique<Type>(std::forward<Args>(args)...);
+
+		std::lock_guard lock(writeMutex);
+		Index* old	= current.load(std::memory_order_relaxed);
+		auto next	= std::make_unique<Index>();
+		next->reserve(old->size() + 1);
+		next->assign(std::begin(*old), std::end(*old));
+		next->emplace_back(elem.get());
+
+		current.store(next.release(), std::memory_order_release);
+		alloc::Epoch::retire(old);
+
+		return *elem.release();
+	}
+
+	template<class Func>
+	void iterate(Func&& func)
+	{
+		alloc::Epoch::Guard guard;
+		for (Type* elem : *current.load(std::memory_order_acquire))
+			if (func(*elem))
+				return;
+	}
+
+	size_t size()
+	{
+		alloc::Epoch::Guard guard;
+		return current.load(std::memory_order_acquire)->size();
+	}
+};
+
+// Lock free, append only vector. Storage is a table of segments that double
+// in size and never move, so references stay valid and appends never copy.
+// An append claims an index with one fetch_add, allocates the segment if it's
+// the first one there and then constructs the element in place.
+//
+// Readers (iterate, operator[]) never lock, elements that have been claimed but
+// aren't constructed yet are skipped. Segments come from Al
+template<class Type, class Al>
+class SegmentedVector
+{
+	static constexpr size_t firstBits	= 3; // First segment holds 8
+	static constexpr size_t segments	= 64 - firstBits;
+
+	struct Slot
+	{
+		alignas(Type) unsigned char	storage[sizeof(Type)];
+		std::atomic<bool>			ready{ false };
+
+		Type& value() noexcept { return *reinterpret_cast<Type*>(storage); }
+	};
+
+	using SlotAl	= typename std::allocator_traits<Al>::template rebind_alloc<Slot>;
+	using Traits	= std::allocator_traits<SlotAl>;
+
+	std::array<std::atomic<Slot*>, segments>	segs;
+	std::atomic<size_t>							claimed;
+	SlotAl										al;
+
+	static constexpr size_t segmentSize(size_t seg) noexcept
+	{
+		return size_t{ 1 } << (seg + firstBits);
+	}
+
+	static constexpr size_t segmentStart(size_t seg) noexcept
+	{
+		return ((size_t{ 1 } << seg) - 1) << firstBits;
+	}
+
+	static std::pair<size_t, size_t> locate(size_t idx) noexcept
+	{
+		const size_t seg = alloc::highestSetBit((idx >> firstBits) + 1);
+		return { seg, idx - segmentStart(seg) };
+	}
+
+	Slot* segment(size_t seg)
+	{
+		Slot* s = segs[seg].load(std::memory_order_acquire);
+		if (s)
+			return s;
+
+		const size_t count	= segmentSize(seg);
+		Slot* fresh			= Traits::allocate(al, count);
+		for (size_t i = 0; i < count; ++i)
+			Traits::construct(al, fresh + i);
+
+		// Someone else got there first
+		if (!segs[seg].compare_exchange_strong(s, fresh, std::memory_order_acq_rel))
+		{
+			freeSegment(fresh, count, 0);
+			return s;
+		}
+		return fresh;
+	}
+
+	void freeSegment(Slot* s, size_t count, size_t used)
+	{
+		for (size_t i = 0; i < count; ++i)
+		{
+			if (i < used && s[i].ready.load(std::memory_order_relaxed))
+				s[i].value().~Type();
+			Traits::destroy(al, s + i);
+		}
+		Traits::deallocate(al, s, count);
+	}
+
+public:
+
+	explicit SegmentedVector(const Al& al = Al{}) :
+		segs{},
+		claimed{	0	},
+		al{			al	}
+	{}
+
+	~SegmentedVector()
+	{
+		const size_t size = claimed.load(std::memory_order_relaxed);
+		for (size_t seg = 0; seg < segments; ++seg)
+			if (Slot* s = segs[seg].load(std::memory_order_relaxed))
+				freeSegment(s, segmentSize(seg), size > segmentStart(seg) ? size - segmentStart(seg) : 0);
+	}
+
+	SegmentedVector(const SegmentedVector& other)				= delete;
+	SegmentedVector& operator=(const SegmentedVector& other)	= delete;
+
+	template<class... Args>
+	Type& emplace_back(Args&& ...args)
+	{
+		const auto [seg, offset]	= locate(claimed.fetch_add(1, std::memory_order_relaxed));
+		Slot& slot					= segment(seg)[offset];
+
+		Type* elem = new (slot.storage) Type(std::forward<Args>(args)...);
+		slot.ready.store(true, std::memory_order_release);
+		return *elem;
+	}
+
+	// idx must have finished being appended
+	Type& operator[](size_t idx) noexcept
+	{
+		const auto [seg, offset] = locate(idx);
+		return segs[seg].load(std::memory_order_acquire)[offset].value();
+	}
+
+	// Takes a lambda which if it returns true stops the loop
+	template<class Func>
+	void iterate(Func&& func)
+	{
+		const size_t size = claimed.load(std::memory_order_acquire);
+		for (size_t seg = 0; segmentStart(seg) < size; ++seg)
+		{
+			Slot* s = segs[seg].load(std::memory_order_acquire);
+			if (!s)
+				continue;
+
+			const size_t count = std::min(segmentSize(seg), size - segmentStart(seg));
+			for (size_t i = 0; i < count; ++i)
+				if (s[i].ready.load(std::memory_order_acquire) && func(s[i].value()))
+					return;
+		}
+	}
+
+	// Includes elements that are still being appended
+	size_t size() const noexcept
+	{
+		return claimed.load(std::memory_order_acquire);
+	}
+
+	bool empty() const noexcept
+	{
+		return !size();
+	}
+};
+
+} // End ImplSmpContainer::
+
+namespace alloc
+{
+
+// Readers and writers share a SharedMutex (one per shard for SmpMap).
+// Writes are cheap, reads still write a reader flag and wait out writers
+struct LockPolicy
+{
+	template<class K, class V, class Hash>
+	using Map = ImplSmpContainer::StripedMap<K, V, Hash>;
+
+	template<class Type>
+	using Vector = ImplSmpContainer::LockedVector<Type>;
+};
+
+// Readers never lock, wait or write anything shared, writers copy the
+// whole container. For things read millions of times for each write
+struct RcuPolicy
+{
+	template<class K, class V, class Hash>
+	using Map = ImplSmpContainer::RcuMap<K, V, Hash>;
+
+	template<class Type>
+	using Vector = ImplSmpContainer::RcuVector<Type>;
+};
+
+// Thread safe map. findDo(key, func(iterator, container)) and iterate(func(value_type&) -> bool)
+// work the same under either policy, and element addresses are stable until they're erased
+template<class K, class V, class Policy = LockPolicy, class Hash = std::hash<K>>
+class SmpMap : public Policy::template Map<K, V, Hash>
+{
+};
+
+// Only has a vector, which is lock free for readers and appenders. Al
+// is only used for the segments, defaults to SlabMulti
+template<class Al = alloc::SlabMulti<std::byte>>
+struct SegmentedPolicy
+{
+	template<class Type>
+	using Vector = ImplSmpContainer::SegmentedVector<Type, Al>;
+};
+
+template<class Type, class Policy = SegmentedPolicy<>>
+class SmpVector : public Policy::template Vector<Type>
+{
+	using Base = typename Policy::template Vector<Type>;
+
+public:
+	using Base::Base;
 };
 
+} // End alloc::
 
-}
\ No newline at end of file
+// SegmentedPolicy's default allocator. Down here since SlabMulti needs SmpMap
+#include "SlabMulti.h"
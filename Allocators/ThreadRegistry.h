@@ -0,0 +1,128 @@
+#pragma once
+#include <mutex>
+#include <vector>
+#include <queue>
+#include <functional>
+#include "AllocHelpers.h"
+
+namespace alloc
+{
+
+// Process wide registry that gives every live thread a small,
+// dense index. Indices are handed out lowest first and recycled
+// when a thread exits, so per thread state can be kept in plain
+// arrays indexed by ThreadRegistry::index() instead of maps keyed on std::thread::id.
+// An index can change once, if the thread asks again from a thread_local
+// destructor that runs after it gave its index back
+class ThreadRegistry
+{
+	using FreeIndices = std::priority_queue<size_t, std::vector<size_t>, std::greater<size_t>>;
+
+	static constexpr size_t NONE = ~size_t{ 0 };
+	static constexpr size_t DEAD = NONE - 1;
+
+	// Gives the thread's index back on thread exit
+	struct Handle
+	{
+		~Handle()
+		{
+			release(myIndex());
+
+			// thread_local destructors that run after this one can still
+			// ask for an index. They mustn't get the one we just gave back,
+			// another thread may already be using it
+			myIndex() = DEAD;
+		}
+	};
+
+	// Trivially destructible, so it's still there while
+	// the thread's other thread_locals are being destroyed
+	static size_t& myIndex() noexcept
+	{
+		thread_local size_t idx = NONE;
+		return idx;
+	}
+
+public:
+
+	// This thread's index. Only the first call on a thread takes a lock
+	static size_t index()
+	{
+		size_t& idx = myIndex();
+		if (idx < DEAD)
+			return idx;
+
+		if (idx == NONE)
+		{
+			idx = acquire();
+			thread_local Handle handle;
+		}
+		else
+			idx = acquireLeaked();
+
+		return idx;
+	}
+
+	// The NUMA node this thread was on the first time it asked. Threads
+	// rarely move between nodes, and when they do this stays put so anything
+	// it was used to pick (a reader slot) can still be found again
+	static int node()
+	{
+		thread_local const int n = alloc::currentNumaNode();
+		return n;
+	}
+
+	// One more than the largest index that has ever been handed out
+	static size_t highWater()
+	{
+		std::lock_guard lock(state().mutex);
+		return state().next;
+	}
+
+private:
+
+	struct State
+	{
+		std::mutex	mutex;
+		FreeIndices	free;
+		size_t		next = 0;
+	};
+
+	// Never destroyed, thread_local and static destructors
+	// that run late can still be asking for indices
+	static State& state()
+	{
+		static State* s = new State;
+		return *s;
+	}
+
+	static size_t acquire()
+	{
+		auto& s = state();
+		std::lock_guard lock(s.mutex);
+		if (s.free.empty())
+			return s.next++;
+
+		auto idx = s.free.top();
+		s.free.pop();
+		return idx;
+	}
+
+	// An index that's never given back, for threads that
+	// need one after they've released their own
+	static size_t acquireLeaked()
+	{
+		auto& s = state();
+		std::lock_guard lock(s.mutex);
+		return s.next++;
+	}
+
+	static void release(size_t idx)
+	{
+		auto& s = state();
+		std::lock_guard lock(s.mutex);
+		s.free.emplace(idx);
+	}
+};
+
+} // End alloc::
@@ -0,0 +1,218 @@
+#pragma once
+#include <memory>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+#include "AllocHelpers.h"
+
+namespace ImplVector
+{
+// Detect the optional allocator extensions
+// (allocate_at_least/try_expand/reallocate) so Vector
+// can fall back to a plain allocate/move/deallocate cycle
+template<class Al, class = void>
+struct HasAtLeast : std::false_type {};
+
+template<class Al>
+struct HasAtLeast<Al, std::void_t<decltype(
+	std::declval<Al&>().allocate_at_least(size_t{}))>>
+	: std::true_type {};
+
+template<class Al, class = void>
+struct HasTryExpand : std::false_type {};
+
+template<class Al>
+struct HasTryExpand<Al, std::void_t<decltype(
+	std::declval<Al&>().try_expand(std::declval<typename Al::value_type*>(), size_t{}, size_t{}))>>
+	: std::true_type {};
+
+template<class Al, class = void>
+struct HasReallocate : std::false_type {};
+
+template<class Al>
+struct HasReallocate<Al, std::void_t<decltype(
+	std::declval<Al&>().reallocate(std::declval<typename Al::value_type*>(), size_t{}, size_t{}))>>
+	: std::true_type {};
+
+} // End ImplVector::
+
+namespace alloc
+{
+
+// A small std::vector like container that takes advantage of
+// the size class slack and in place resizing some of our
+// allocators support (SlabMulti, FreeList, SlabMem). Allocators
+// without those extensions still work, they just always move
+template<class Type, class Al>
+class Vector
+{
+public:
+	using value_type		= Type;
+	using allocator_type	= typename Al::template rebind<Type>::other;
+	using size_type			= size_t;
+	using iterator			= Type*;
+	using const_iterator	= const Type*;
+
+private:
+	using Trivial			= std::is_trivially_copyable<Type>;
+
+	allocator_type	al;
+	Type*			MyBegin;
+	size_type		MySize;
+	size_type		MyCapacity;
+
+	static constexpr size_type MIN_CAPACITY = 4;
+
+public:
+
+	Vector() :
+		Vector{ allocator_type{} }
+	{}
+
+	template<class A>
+	explicit Vector(const A& al) :
+		al{			al		},
+		MyBegin{	nullptr },
+		MySize{		0		},
+		MyCapacity{ 0		}
+	{}
+
+	Vector(Vector&& other) noexcept :
+		al{			other.al			},
+		MyBegin{	other.MyBegin		},
+		MySize{		other.MySize		},
+		MyCapacity{ other.MyCapacity	}
+	{
+		other.MyBegin		= nullptr;
+		other.MySize		= 0;
+		other.MyCapacity	= 0;
+	}
+
+	Vector(const Vector& other)				= delete;
+	Vector& operator=(const Vector& other)	= delete;
+
+	~Vector()
+	{
+		clear();
+		if (MyBegin)
+			al.deallocate(MyBegin, MyCapacity);
+	}
+
+	iterator begin()				noexcept { return MyBegin; }
+	iterator end()					noexcept { return MyBegin + MySize; }
+	const_iterator begin()	const	noexcept { return MyBegin; }
+	const_iterator end()	const	noexcept { return MyBegin + MySize; }
+	Type* data()					noexcept { return MyBegin; }
+	Type& back()					noexcept { return MyBegin[MySize - 1]; }
+	Type& operator[](size_type idx) noexcept { return MyBegin[idx]; }
+	size_type size()		const	noexcept { return MySize; }
+	size_type capacity()	const	noexcept { return MyCapacity; }
+	bool empty()			const	noexcept { return !MySize; }
+
+	template<class... Args>
+	Type& emplace_back(Args&& ...args)
+	{
+		if (MySize == MyCapacity)
+		{
+			// args may refer to one of our elements (v.push_back(v[0])),
+			// so build the new one before growing can free them
+			Type tmp(std::forward<Args>(args)...);
+			setCapacity(MyCapacity ? MyCapacity * 2 : MIN_CAPACITY);
+			new (MyBegin + MySize) Type(std::move(tmp));
+		}
+		else
+			new (MyBegin + MySize) Type(std::forward<Args>(args)...);
+
+		return MyBegin[MySize++];
+	}
+
+	void push_back(const Type& t)	{ emplace_back(t); }
+	void push_back(Type&& t)		{ emplace_back(std::move(t)); }
+
+	void pop_back()
+	{
+		MyBegin[--MySize].~Type();
+	}
+
+	void clear()
+	{
+		for (size_type i = 0; i < MySize; ++i)
+			MyBegin[i].~Type();
+		MySize = 0;
+	}
+
+	void reserve(size_type count)
+	{
+		if (count > MyCapacity)
+			setCapacity(count);
+	}
+
+	void shrink_to_fit()
+	{
+		if (MySize == MyCapacity)
+			return;
+
+		if (!MySize)
+		{
+			al.deallocate(MyBegin, MyCapacity);
+			MyBegin		= nullptr;
+			MyCapacity	= 0;
+			return;
+		}
+		setCapacity(MySize);
+	}
+
+private:
+
+	// Grow or shrink the storage to count elements, preferring
+	// (in order) an in place resize, a realloc for trivially
+	// copyable types, and lastly a new allocation + move
+	void setCapacity(size_type count)
+	{
+		if constexpr (ImplVector::HasTryExpand<allocator_type>::value)
+			if (MyBegin && al.try_expand(MyBegin, MyCapacity, count))
+			{
+				MyCapacity = count;
+				return;
+			}
+
+		if constexpr (Trivial::value
+			&& ImplVector::HasReallocate<allocator_type>::value
+			&& !ImplVector::HasAtLeast<allocator_type>::value)
+		{
+			MyBegin		= MyBegin ? al.reallocate(MyBegin, MyCapacity, count) : al.allocate(count);
+			MyCapacity	= count;
+			return;
+		}
+
+		auto[mem, cap] = allocateAtLeast(count);
+
+		if constexpr (Trivial::value)
+		{
+			if (MySize)
+				std::memcpy(mem, MyBegin, sizeof(Type) * MySize);
+		}
+		else
+			for (size_type i = 0; i < MySize; ++i)
+			{
+				new (mem + i) Type(std::move(MyBegin[i]));
+				MyBegin[i].~Type();
+			}
+
+		if (MyBegin)
+			al.deallocate(MyBegin, MyCapacity);
+
+		MyBegin		= mem;
+		MyCapacity	= cap;
+	}
+
+	allocation_result<Type> allocateAtLeast(size_type count)
+	{
+		if constexpr (ImplVector::HasAtLeast<allocator_type>::value)
+			return al.allocate_at_least(count);
+		else
+			return { al.allocate(count), count };
+	}
+};
+
+} // End alloc::
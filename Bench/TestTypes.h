@@ -98,6 +98,19 @@ struct LockedAlInterface
 			al->deallocate(ptr, n);
 	}
 
+	// Runs func(al) under the lock if the allocator needs it
+	template<class Func>
+	decltype(auto) locked(Func&& func)
+	{
+		if constexpr (std::is_same_v<Thread_Safe, std::false_type>)
+		{
+			std::lock_guard lock(mutex);
+			return func(*al);
+		}
+		else
+			return func(*al);
+	}
+
 	Al*					al;
 	mutable std::mutex	mutex;
 };
@@ -167,6 +180,26 @@ public:
 		sharedInterface->deallocate(ptr, n);
 	}
 
+	// The optional extensions are only forwarded when Al has them,
+	// so alloc::Vector detects the same ones it would without the lock
+	template<class A = Al>
+	auto allocate_at_least(size_t n) -> decltype(std::declval<A&>().template allocate_at_least<Type>(n))
+	{
+		return sharedInterface->locked([&](A& al) { return al.template allocate_at_least<Type>(n); });
+	}
+
+	template<class A = Al>
+	auto try_expand(Type* ptr, size_t oldCount, size_t newCount) -> decltype(std::declval<A&>().try_expand(ptr, oldCount, newCount))
+	{
+		return sharedInterface->locked([&](A& al) { return al.try_expand(ptr, oldCount, newCount); });
+	}
+
+	template<class A = Al>
+	auto reallocate(Type* ptr, size_t oldCount, size_t newCount) -> decltype(std::declval<A&>().reallocate(ptr, oldCount, newCount))
+	{
+		return sharedInterface->locked([&](A& al) { return al.reallocate(ptr, oldCount, newCount); });
+	}
+
 private:
 	Interface* sharedInterface;
 };
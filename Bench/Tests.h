@@ -7,6 +7,8 @@
 #include <iomanip>
 #include <string>
 #include <future>
+#include <thread>
+#include <atomic>
 
 // TODO: Encapsualte in "Benchs" namespace
 
@@ -337,4 +339,90 @@ double shrinkToFit(Init& init, Alloc& al)
 	};
 
 	return callFuncAsync(init, lockedAl, func, 1000000, 2500);
-}
\ No newline at end of file
+}
+
+// Same idea as shrinkToFit, but through alloc::Vector so allocators 
+// that can resize in place (or hand out size class slack) get to use it
+template<class Init, class Alloc>
+double vecShrinkToFit(Init&, Alloc& al, size_t iterations, size_t maxAllocs, size_t seed, std::true_type)
+{
+	using TimeType = std::chrono::milliseconds;
+	alloc::Vector<int, Alloc> vec{ al };
+	std::default_random_engine re(seed);
+	std::uniform_int_distribution dis(1, 64);
+
+	auto start = Clock::now();
+	for (size_t i = 0; i < iterations; ++i)
+	{
+		vec.emplace_back(static_cast<int>(i));
+
+		if (dis(re) == 1)
+			vec.shrink_to_fit();
+
+		if (vec.size() >= maxAllocs)
+		{
+			vec.clear();
+			vec.shrink_to_fit();
+		}
+	}
+	auto end = Clock::now();
+	return static_cast<double>(std::chrono::duration_cast<TimeType>(end - start).count());
+}
+
+template<class Init, class Alloc>
+double vecShrinkToFit(Init&, Alloc&, size_t, size_t, size_t, std::false_type) { return 0.0; }
+
+template<class Init, class Alloc>
+double vecShrinkToFit(Init& init, Alloc& al)
+{
+	LockedAl<Alloc, int> lockedAl{ al };
+
+	auto func = [&](size_t iterations, size_t maxAllocs, size_t seed, auto trueType)
+	{
+		return vecShrinkToFit(init, lockedAl, iterations, maxAllocs, seed, trueType);
+	};
+
+	return callFuncAsync(init, lockedAl, func, iterations, maxAllocs);
+}
+
+// Half the threads push iterations ints through the queue while the
+// other half pop them. push returns false when a bounded queue is full
+template<class Push, class Pop>
+double queueHandoff(Push&& push, Pop&& pop)
+{
+	using TimeType = std::chrono::milliseconds;
+
+	constexpr int producers = TestThreads / 2;
+	constexpr int consumers = TestThreads - producers;
+	constexpr int perThread = iterations / producers;
+
+	std::atomic<int>			popped = 0;
+	std::vector<std::thread>	threads;
+
+	auto start = Clock::now();
+
+	for (int i = 0; i < producers; ++i)
+		threads.emplace_back([&]()
+		{
+			for (int v = 0; v < perThread; ++v)
+				while (!push(v))
+					std::this_thread::yield();
+		});
+
+	for (int i = 0; i < consumers; ++i)
+		threads.emplace_back([&]()
+		{
+			int v;
+			while (popped.load(std::memory_order_relaxed) < perThread * producers)
+				if (pop(v))
+					popped.fetch_add(1, std::memory_order_relaxed);
+				else
+					std::this_thread::yield();
+		});
+
+	for (auto& t : threads)
+		t.join();
+
+	auto end = Clock::now();
+	return static_cast<double>(std::chrono::duration_cast<TimeType>(end - start).count());
+}
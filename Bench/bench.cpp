@@ -1,6 +1,9 @@
 #include "../Allocators/Slab.h"
 #include "../Allocators/FreeList.h"
 #include "../Allocators/SlabMulti.h"
+#include "../Allocators/Vector.h"
+#include "../Allocators/LockFree.h"
+#include <deque>
 #include <memory>
 #include "TestTypes.h"
 #include "Tests.h"
@@ -15,6 +18,7 @@ constexpr auto FreeListBytes = (150 + sizeof(alloc::FreeList<PartialInit, 999999
 alloc::FreeList<int, FreeListBytes, alloc::ListPolicy> freeAlList;
 alloc::FreeList<int, FreeListBytes, alloc::FlatPolicy> freeAlFlat;
 alloc::FreeList<int, FreeListBytes, alloc::TreePolicy> freeAlTree;
+alloc::FreeList<int, FreeListBytes, alloc::TlsfPolicy> freeAlTlsf;
 
 enum AllocMasks
 {
@@ -22,10 +26,11 @@ enum AllocMasks
 	FL_LIST		= 1 << 1,
 	FL_FLAT		= 1 << 2,
 	FL_TREE		= 1 << 3,
-	SLAB_MEM	= 1 << 4,
-	SLAB_OBJ	= 1 << 5,
-	SLAB_MULTI	= 1 << 6,
-	ALL_ALLOCS	= (1 << 7) - 1
+	FL_TLSF		= 1 << 4,
+	SLAB_MEM	= 1 << 5,
+	SLAB_OBJ	= 1 << 6,
+	SLAB_MULTI	= 1 << 7,
+	ALL_ALLOCS	= (1 << 8) - 1
 };
 
 enum BenchMasks
@@ -40,7 +45,8 @@ enum BenchMasks
 	STR_AL_DE	= 1 << 5,
 	MULTI_STR	= 1 << 6,
 	MULTI_STF	= 1 << 7,
-	ALL_BENCH	= (1 << 8) - 1,
+	VEC_STF		= 1 << 8,
+	ALL_BENCH	= (1 << 9) - 1,
 	NON_T_MSK	= ALL_BENCH ^ TYPE_MSK,	// Mask for all non-type dependent benchmarks
 };
 
@@ -101,7 +107,7 @@ inline bool isValid(size_t alMask, size_t bMask, size_t testMask)
 template<class Init, class Alloc, class Ctor>
 decltype(auto) benchAlT(Init& init, Alloc& al, Ctor& ctor, bool nonType, int count, size_t alMask, size_t bMask)
 {
-	std::vector<double> scores(8, 0.0);
+	std::vector<double> scores(9, 0.0);
 
 	int i;
 	for (i = 0; i < count; ++i)
@@ -127,6 +133,8 @@ decltype(auto) benchAlT(Init& init, Alloc& al, Ctor& ctor, bool nonType, int cou
 				scores[6] += multiStrAl(init, al);
 			if (isValid(alMask, bMask, BenchMasks::MULTI_STF))
 				scores[7] += shrinkToFit(init, al);
+			if (isValid(alMask, bMask, BenchMasks::VEC_STF))
+				scores[8] += vecShrinkToFit(init, al);
 		}
 	}
 	
@@ -151,8 +159,8 @@ template<class T>
 void printScores(std::vector<std::vector<double>>& scores, size_t alMask, size_t bMask, bool isStruct = true)
 {
 	static constexpr int printWidth = 11;
-	static const std::vector<std::string> benchNames	= { "Alloc", "Al/De", "R Al/De", "SeqRead", "RandRead", "StrAl/De", "MultiStr", "MultiStf" };
-	static const std::vector<std::string> allocNames	= { "Default: ", "FLstList: ", "FLstFlat: ", "FLstTree: ", "SlabMem: ", "SlabObj: ", "SlabMulti: " };
+	static const std::vector<std::string> benchNames	= { "Alloc", "Al/De", "R Al/De", "SeqRead", "RandRead", "StrAl/De", "MultiStr", "MultiStf", "VecStf" };
+	static const std::vector<std::string> allocNames	= { "Default: ", "FLstList: ", "FLstFlat: ", "FLstTree: ", "FLstTLSF: ", "SlabMem: ", "SlabObj: ", "SlabMulti: " };
 
 	std::vector<std::string> bNames;
 	std::vector<std::string> alNames;
@@ -231,6 +239,14 @@ decltype(auto) benchAllocs(Ctor& ctor, int runs, size_t alMask = ALL_ALLOCS, siz
 		scores.emplace_back(benchAlT(init, freeAlTree, ctor, nonType, runs, FL_TREE, bMask));
 	}
 
+	// FreeList: TlsfPolicy
+	if (alMask & FL_TLSF)
+	{
+		auto[Al, De] = alWrapper(freeAlTlsf);
+		BenchT init(T{}, ctor, Al, De, re);
+		scores.emplace_back(benchAlT(init, freeAlTlsf, ctor, nonType, runs, FL_TLSF, bMask));
+	}
+
 	// SlabMem
 	if (alMask & SLAB_MEM)
 	{
@@ -259,6 +275,74 @@ decltype(auto) benchAllocs(Ctor& ctor, int runs, size_t alMask = ALL_ALLOCS, siz
 	return scores;
 }
 
+enum QueueMasks
+{
+	MUTEX_DEQUE	= 1,
+	LF_QUEUE	= 1 << 1,
+	BOUNDED_Q	= 1 << 2,
+	LF_STACK	= 1 << 3,
+	ALL_QUEUES	= (1 << 4) - 1
+};
+
+// Cross thread handoff through the lock free containers vs a std::mutex + std::deque
+inline void benchQueues(int runs, size_t qMask = ALL_QUEUES)
+{
+	static const std::vector<std::string> queueNames = { "MtxDeque: ", "LFQueue: ", "Bounded: ", "LFStack: " };
+
+	std::vector<double> scores;
+	for (size_t m = 1; m < ALL_QUEUES; m <<= 1)
+	{
+		if (!(m & qMask))
+			continue;
+
+		double total = 0.0;
+		for (int i = 0; i < runs; ++i)
+		{
+			if (m == MUTEX_DEQUE)
+			{
+				std::mutex		mutex;
+				std::deque<int>	deque;
+				total += queueHandoff(
+					[&](int v) { std::lock_guard lock(mutex); deque.push_back(v); return true; },
+					[&](int& v)
+					{
+						std::lock_guard lock(mutex);
+						if (deque.empty())
+							return false;
+						v = deque.front();
+						deque.pop_front();
+						return true;
+					});
+			}
+			else if (m == LF_QUEUE)
+			{
+				alloc::LockFreeQueue<int> queue;
+				total += queueHandoff([&](int v) { queue.push(v); return true; }, [&](int& v) { return queue.pop(v); });
+			}
+			else if (m == BOUNDED_Q)
+			{
+				alloc::BoundedQueue<int> queue{ 1 << 12 };
+				total += queueHandoff([&](int v) { return queue.push(v); }, [&](int& v) { return queue.pop(v); });
+			}
+			else
+			{
+				alloc::LockFreeStack<int> stack;
+				total += queueHandoff([&](int v) { stack.push(v); return true; }, [&](int& v) { return stack.pop(v); });
+			}
+		}
+		scores.emplace_back(total / runs);
+	}
+
+	std::vector<std::string> names;
+	buildNames(queueNames, names, qMask);
+
+	std::cout << "Queue handoff scores: \n";
+	for (size_t i = 0; i < scores.size(); ++i)
+		std::cout << std::left << std::setw(11) << names[i] 
+			<< std::right << std::setw(11) << std::fixed << std::setprecision(1) << scores[i] << '\n';
+	std::cout << '\n';
+}
+
 inline void addScores(std::vector<std::vector<double>>& first,
 	std::vector<std::vector<double>> second)
 {
@@ -321,6 +405,8 @@ int main()
 	// Non type based tests
 	benchAllocs<NonType, defCtorT>(alloc::defaultXtor, numTests, allocMask, benchMask & BenchMasks::NON_T_MSK);
 
+	benchQueues(numTests);
+
 	std::cout << "\nOptimization var: " << TestV << '\n';
 	return 0;
 }
\ No newline at end of file
@@ -4,6 +4,7 @@
 
 #include <vector>
 #include <random>
+#include <thread>
 
 using namespace Microsoft::VisualStudio::CppUnitTestFramework;
 namespace Tests
@@ -18,30 +19,24 @@ namespace Tests
 		using LAllocator			= alloc::FreeList<int, alSize, alloc::ListPolicy>;
 		using FAllocator			= alloc::FreeList<int, alSize, alloc::FlatPolicy>;
 		using TAllocator			= alloc::FreeList<int, alSize, alloc::TreePolicy>;
+		using SAllocator			= alloc::FreeList<int, alSize, alloc::TlsfPolicy>;
 
 		using lsType				= LAllocator::size_type; // Allocator size type for list pol
-		using LPol					= typename LAllocator::OurPolicy::OurPolicy;
-		using FPol					= typename FAllocator::OurPolicy::OurPolicy;
-		using TPol					= typename TAllocator::OurPolicy::OurPolicy;
-		using Header				= typename LAllocator::OurPolicy::Header;
 
+		// Each allocator has its own arena. Through al.arena() (the policy
+		// interface that interfaces with the different allocator policies)
+		// we can walk the blocks, check the free byte count, etc
 		LAllocator listAl;
 		FAllocator flatAl;
 		TAllocator treeAl;
-		// This is the policy interface that interfaces with
-		// different allocator policies
-		LAllocator::OurPolicy lItf;
-		FAllocator::OurPolicy fItf;
-		TAllocator::OurPolicy tItf;
-		// A particular allocator policy. From here we can access
-		// the list of free mem blocks, etc
-		LPol lPol;
-		FPol fPol;
-		TPol tPol;
-
-		template<class Al, class Itf, class Pol>
-		void testAlloc(Al& al, Itf& itf, Pol& pol)
+		SAllocator tlsfAl;
+
+		template<class Al>
+		void testAlloc(Al& al)
 		{
+			using Itf		= typename Al::OurPolicy;
+			const Itf& itf	= al.arena();
+
 			// Shouldn't be able to allocate full size, 
 			// we need to store header info
 			bool failed = false;
@@ -57,10 +52,11 @@ namespace Tests
 			Assert::IsTrue(static_cast<lType>(itf.bytesFree) == alSize);
 			Assert::IsTrue(failed);
 
-			// Allocate close to the total amount possible
+			// Allocate close to the total amount possible, leaving one block
 			constexpr lType perAl = 2;
-			constexpr lType count = alSize / (sizeof(lType) + sizeof(Header)) / perAl;
-			lType* ptrs[count];
+			const lType block		= Itf::blockBytes(sizeof(lType) * perAl);
+			const lType count		= alSize / block - 1;
+			std::vector<lType*> ptrs(count);
 
 			for (int i = 0; i < count; ++i)
 			{
@@ -70,12 +66,13 @@ namespace Tests
 			}
 
 			// Remaining bytes(what it should be) equal to what was allocated
-			const lsType remainingBytes = alSize - static_cast<lsType>(count * (sizeof(Header) + sizeof(lType) * perAl));
+			const lsType remainingBytes = static_cast<lsType>(alSize - count * block);
 
 			// Check byte count is correct
 			Assert::IsTrue(itf.bytesFree == remainingBytes);
 			// Check remaining chunk mem size is matching our count
-			Assert::IsTrue(pol.availible.begin()->second == remainingBytes);
+			Assert::IsTrue(itf.freeBlocks()		== 1);
+			Assert::IsTrue(itf.largestFree()	== remainingBytes);
 
 			// And test to make sure nothing is overwritten
 			for (int i = 0; i < count; ++i)
@@ -87,20 +84,24 @@ namespace Tests
 
 		TEST_METHOD(Allocation)
 		{
-			testAlloc(listAl, lItf,  lPol);
-			testAlloc(flatAl, fItf,  fPol);
-			testAlloc(treeAl, tItf,  tPol);
+			testAlloc(listAl);
+			testAlloc(flatAl);
+			testAlloc(treeAl);
+			testAlloc(tlsfAl);
 		}
 
-		template<class Al, class Itf, class Pol>
-		void testDealloc(Al& al, Itf& itf, Pol& pol)
+		template<class Al>
+		void testDealloc(Al& al)
 		{
+			using Itf		= typename Al::OurPolicy;
+			const Itf& itf	= al.arena();
+
 			Assert::IsTrue(static_cast<lType>(itf.bytesFree) == alSize);
 
 			// Allocate close to the total amount possible
-			constexpr lType perAl = 2;
-			constexpr lType count = alSize / (sizeof(lType) + sizeof(Header)) / perAl;
-			lType* ptrs[count];
+			constexpr lType perAl	= 2;
+			const lType count		= alSize / Itf::blockBytes(sizeof(lType) * perAl);
+			std::vector<lType*> ptrs(count);
 
 			std::vector<int> idxs;
 			for (int i = 0; i < count; ++i)
@@ -121,39 +122,225 @@ namespace Tests
 			Assert::IsTrue(itf.bytesFree == static_cast<lsType>(alSize));
 
 			// Should only be one large block
-			Assert::IsTrue(pol.availible.size() == 1);
+			Assert::IsTrue(itf.freeBlocks() == 1);
 
 			// Check remaining chunk mem size is matching our count
-			Assert::IsTrue(pol.availible.begin()->second == static_cast<lsType>(alSize));
+			Assert::IsTrue(itf.largestFree() == static_cast<lsType>(alSize));
 		}
 
 		TEST_METHOD(Deallocation)
 		{
-			testDealloc(listAl, lItf, lPol);
-			testDealloc(flatAl, fItf, fPol);
-			testDealloc(treeAl, tItf, tPol);
+			testDealloc(listAl);
+			testDealloc(flatAl);
+			testDealloc(treeAl);
+			testDealloc(tlsfAl);
 		}
 
-		template<class Al, class Itf, class Pol>
-		void testFreeAll(Al& al, Itf& itf, Pol& pol)
+		template<class Al>
+		void testFreeAll(Al& al)
 		{
-			constexpr lType perAl = 2;
-			constexpr lType count = alSize / (sizeof(lType) + sizeof(Header)) / perAl;
+			using Itf		= typename Al::OurPolicy;
+			const Itf& itf	= al.arena();
+
+			constexpr lType perAl	= 2;
+			const lType count		= alSize / Itf::blockBytes(sizeof(lType) * perAl);
 			for (int i = 0; i < count; ++i)
 				al.allocate(perAl);
 
 			al.freeAll();
 
-			Assert::IsTrue(itf.bytesFree					== alSize);
-			Assert::IsTrue(pol.availible.size()				==		1);
-			Assert::IsTrue(pol.availible.begin()->second	== alSize);
+			Assert::IsTrue(itf.bytesFree		== alSize);
+			Assert::IsTrue(itf.freeBlocks()		==		1);
+			Assert::IsTrue(itf.largestFree()	== alSize);
 		}
 
 		TEST_METHOD(FreeAll)
 		{
-			testFreeAll(listAl, lItf, lPol);
-			testFreeAll(flatAl, fItf, fPol);
-			testFreeAll(treeAl, tItf, tPol);
+			testFreeAll(listAl);
+			testFreeAll(flatAl);
+			testFreeAll(treeAl);
+			testFreeAll(tlsfAl);
+		}
+
+		template<class Al>
+		void testExpand(Al& al)
+		{
+			using Itf		= typename Al::OurPolicy;
+			const Itf& itf	= al.arena();
+
+			lType* first	= al.allocate(2);
+			lType* second	= al.allocate(2);
+			first[0]		= 1;
+			first[1]		= 2;
+
+			// second is directly after first, so first can't grow yet
+			Assert::IsFalse(al.try_expand(first, 2, 4));
+
+			al.deallocate(second, 2);
+			const auto freeBefore = itf.bytesFree;
+
+			Assert::IsTrue(al.try_expand(first, 2, 4));
+			const auto afterGrow = itf.bytesFree;
+			Assert::IsTrue(afterGrow == freeBefore - (Itf::blockBytes(4 * sizeof(lType)) - Itf::blockBytes(2 * sizeof(lType))));
+			Assert::IsTrue(first[0] == 1 && first[1] == 2);
+
+			// Shrinking gives the tail back, if it's large enough to be a block
+			const size_t tail = Itf::blockBytes(4 * sizeof(lType)) - Itf::blockBytes(sizeof(lType));
+			Assert::IsTrue(al.try_expand(first, 4, 1));
+			Assert::IsTrue(itf.bytesFree	== afterGrow + (tail >= Itf::minBlock ? tail : 0));
+			Assert::IsTrue(itf.freeBlocks()	== 1);
+
+			lType* moved = al.reallocate(first, 1, 8);
+			Assert::IsTrue(moved[0] == 1);
+
+			al.deallocate(moved, 8);
+			Assert::IsTrue(itf.bytesFree == static_cast<lsType>(alSize));
+			al.freeAll();
+		}
+
+		TEST_METHOD(Expand)
+		{
+			testExpand(listAl);
+			testExpand(flatAl);
+			testExpand(treeAl);
+			testExpand(tlsfAl);
+		}
+
+		// Frees every other block then checks first fit hands
+		// back the lowest addressed hole that's large enough
+		template<class Al>
+		void testCoalesce(Al& al)
+		{
+			using Itf		= typename Al::OurPolicy;
+			const Itf& itf	= al.arena();
+
+			constexpr lType count = 8;
+			lType* ptrs[count];
+			for (int i = 0; i < count; ++i)
+				ptrs[i] = al.allocate(2);
+
+			// The last one joins the free space after it
+			for (int i = 1; i < count; i += 2)
+				al.deallocate(ptrs[i], 2);
+			Assert::IsTrue(itf.freeBlocks() == count / 2);
+
+			// Freeing 2 joins it with both of its neighbours
+			al.deallocate(ptrs[2], 2);
+			Assert::IsTrue(itf.freeBlocks() == count / 2 - 1);
+
+			lType* big = al.allocate(6);
+			Assert::IsTrue(big == ptrs[1]);
+
+			al.freeAll();
+			Assert::IsTrue(itf.freeBlocks() == 1);
+		}
+
+		TEST_METHOD(Coalesce)
+		{
+			testCoalesce(listAl);
+			testCoalesce(flatAl);
+			testCoalesce(treeAl);
+			testCoalesce(tlsfAl);
+		}
+
+		template<class Al>
+		void testBestFit(Al& al)
+		{
+			al.setSearch(FreeListImpl::BEST_FIT);
+
+			// The 1's keep big and small from joining
+			lType* big		= al.allocate(8);
+			al.allocate(1);
+			lType* small	= al.allocate(3);
+			al.allocate(1);
+
+			al.deallocate(small, 3);
+			al.deallocate(big, 8);
+
+			// big and the rest of the arena fit too, but small is the closest
+			Assert::IsTrue(al.allocate(3) == small);
+			Assert::IsTrue(al.allocate(6) == big);
+
+			al.freeAll();
+			al.setSearch(FreeListImpl::FIRST_FIT);
+		}
+
+		TEST_METHOD(BestFit)
+		{
+			testBestFit(listAl);
+			testBestFit(flatAl);
+			testBestFit(treeAl);
+			testBestFit(tlsfAl);
+		}
+
+		// Rounding a request near the top of the arena up to a whole
+		// block mustn't wrap size_type around to a tiny block
+		TEST_METHOD(Size_Overflow)
+		{
+			alloc::FreeList<char, 65535, alloc::ListPolicy> al;
+			const auto& itf		= al.arena();
+			const auto free		= itf.bytesFree;
+
+			bool failed = false;
+			try
+			{
+				al.allocate(65532);
+			}
+			catch (const std::bad_alloc&)
+			{
+				failed = true;
+			}
+			Assert::IsTrue(failed);
+			Assert::IsTrue(itf.bytesFree == free);
+
+			char* p = al.allocate(4);
+			Assert::IsFalse(al.try_expand(p, 4, 65532));
+			al.deallocate(p, 4);
+			Assert::IsTrue(itf.bytesFree == free);
+		}
+
+		TEST_METHOD(Separate_Arenas)
+		{
+			LAllocator other;
+			int* p = listAl.allocate(4);
+
+			Assert::IsTrue(listAl != other);
+			Assert::IsTrue(other.arena().bytesFree == alSize);
+			Assert::IsTrue(listAl.arena().bytesFree < alSize);
+
+			// Copies and rebinds share the arena
+			LAllocator copy = listAl;
+			alloc::FreeList<char, alSize, alloc::ListPolicy> rebound{ listAl };
+			Assert::IsTrue(copy == listAl);
+			Assert::IsTrue(rebound == listAl);
+
+			copy.deallocate(p, 4);
+			Assert::IsTrue(listAl.arena().bytesFree == alSize);
+		}
+
+		// Every thread gets its own heap, there's no state between them to race on
+		TEST_METHOD(Thread_Arenas)
+		{
+			std::vector<std::thread> threads;
+			for (int t = 0; t < 4; ++t)
+				threads.emplace_back([]
+				{
+					for (int i = 0; i < 100; ++i)
+					{
+						TAllocator al;
+						std::vector<lType*> ptrs;
+						for (int j = 0; j < 16; ++j)
+							ptrs.emplace_back(al.allocate(j % 5 + 1));
+
+						for (auto* p : ptrs)
+							al.deallocate(p, 1);
+
+						Assert::IsTrue(al.arena().freeBlocks() == 1);
+					}
+				});
+
+			for (auto& t : threads)
+				t.join();
 		}
 
 		TEST_METHOD(STD_Containers) // TODO: add test to make sure each works with the std::containers
@@ -163,4 +350,4 @@ namespace Tests
 
 	};
 
-}
\ No newline at end of file
+}
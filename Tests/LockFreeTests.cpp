@@ -0,0 +1,126 @@
+#include "stdafx.h"
+#include "CppUnitTest.h"
+#include "../Allocators/LockFree.h"
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <string>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+
+namespace Tests
+{
+
+// Producers push 1..n between them while consumers pop until they've
+// seen all of them, every value has to come out exactly once
+template<class Queue>
+void handoff(Queue& queue)
+{
+	constexpr size_t producers	= 2;
+	constexpr size_t consumers	= 2;
+	constexpr size_t perThread	= 20000;
+	constexpr size_t total		= producers * perThread;
+
+	std::atomic<size_t>			popped	= 0;
+	std::atomic<size_t>			sum		= 0;
+	std::vector<std::thread>	threads;
+
+	for (size_t p = 0; p < producers; ++p)
+		threads.emplace_back([&, p]()
+		{
+			for (size_t i = 1; i <= perThread; ++i)
+				while (!queue.push(p * perThread + i))
+					std::this_thread::yield();
+		});
+
+	for (size_t c = 0; c < consumers; ++c)
+		threads.emplace_back([&]()
+		{
+			size_t v;
+			while (popped.load() < total)
+				if (queue.pop(v))
+				{
+					sum += v;
+					++popped;
+				}
+		});
+
+	for (auto& t : threads)
+		t.join();
+
+	size_t v;
+	Assert::IsFalse(queue.pop(v));
+	Assert::AreEqual(total * (total + 1) / 2, sum.load());
+}
+
+// Gives LockFreeQueue and LockFreeStack the same push signature as BoundedQueue
+template<class Container>
+struct AlwaysPush : Container
+{
+	bool push(size_t v)
+	{
+		Container::push(v);
+		return true;
+	}
+};
+
+TEST_CLASS(LockFreeTests)
+{
+public:
+
+	TEST_METHOD(Queue_Handoff)
+	{
+		AlwaysPush<alloc::LockFreeQueue<size_t>> queue;
+		handoff(queue);
+	}
+
+	TEST_METHOD(Stack_Handoff)
+	{
+		AlwaysPush<alloc::LockFreeStack<size_t>> stack;
+		handoff(stack);
+	}
+
+	TEST_METHOD(Bounded_Handoff)
+	{
+		alloc::BoundedQueue<size_t> queue{ 64 };
+		handoff(queue);
+	}
+
+	TEST_METHOD(Bounded_Full_Empty)
+	{
+		alloc::BoundedQueue<std::string> queue{ 3 };
+		Assert::AreEqual(size_t{ 4 }, queue.capacity());
+
+		for (int i = 0; i < 4; ++i)
+			Assert::IsTrue(queue.push(std::to_string(i)));
+		Assert::IsFalse(queue.push("full"));
+
+		std::string s;
+		for (int i = 0; i < 4; ++i)
+		{
+			Assert::IsTrue(queue.pop(s));
+			Assert::AreEqual(std::to_string(i), s);
+		}
+		Assert::IsFalse(queue.pop(s));
+
+		// Left in the queue for the destructor
+		queue.push("a long enough string to be heap allocated");
+	}
+
+	TEST_METHOD(Stack_Order)
+	{
+		alloc::LockFreeStack<std::string> stack;
+		for (int i = 0; i < 1000; ++i)
+			stack.push(std::to_string(i));
+
+		std::string s;
+		for (int i = 999; i >= 500; --i)
+		{
+			Assert::IsTrue(stack.pop(s));
+			Assert::AreEqual(std::to_string(i), s);
+		}
+		Assert::IsFalse(stack.empty());
+	}
+};
+
+}
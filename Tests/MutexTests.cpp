@@ -0,0 +1,472 @@
+#include "stdafx.h"
+#include "CppUnitTest.h"
+#include "../Allocators/BiasedMutex.h"
+#include "../Allocators/ThreadRegistry.h"
+#include "../Allocators/SharedMutex.h"
+#include <mutex>
+#include <shared_mutex>
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <chrono>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+
+namespace Tests
+{
+
+// Threads read a value in upgrade mode and then upgrade and bump it, if anyone got
+// in between the upgrade and the read the value will have changed. Plain readers
+// run alongside and should never see a and b differ
+template<class Mutex>
+void upgradeRace(Mutex& mutex)
+{
+	constexpr int upgraders = 4;
+	constexpr int readers	= 4;
+	constexpr int iters		= 1000;
+
+	int					a = 0;
+	int					b = 0;
+	std::atomic<bool>	mismatch = false;
+
+	auto upgrader = [&]()
+	{
+		for (int i = 0; i < iters; ++i)
+		{
+			alloc::UpgradeLock lock(mutex);
+			const int seen = a;
+
+			if (a != b)
+				mismatch = true;
+
+			if (i % 2)
+			{
+				lock.upgrade();
+				if (a != seen)
+					mismatch = true;
+				++a;
+				++b;
+			}
+		}
+	};
+
+	auto reader = [&]()
+	{
+		for (int i = 0; i < iters; ++i)
+		{
+			std::shared_lock lock(mutex);
+			if (a != b)
+				mismatch = true;
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (int i = 0; i < upgraders; ++i)
+		threads.emplace_back(upgrader);
+	for (int i = 0; i < readers; ++i)
+		threads.emplace_back(reader);
+
+	// Mixed in with a few plain writers
+	for (int i = 0; i < iters / 4; ++i)
+	{
+		std::lock_guard lock(mutex);
+		++a;
+		++b;
+	}
+
+	for (auto& th : threads)
+		th.join();
+
+	Assert::IsFalse(mismatch);
+	Assert::IsTrue(a == upgraders * iters / 2 + iters / 4);
+	Assert::IsTrue(a == b);
+
+	// Downgrading lets readers straight back in
+	mutex.lock();
+	mutex.unlock_and_lock_upgrade();
+	std::thread([&]() { std::shared_lock lock(mutex); }).join();
+	mutex.unlock_upgrade();
+}
+
+TEST_CLASS(BiasedMutexTests)
+{
+public:
+
+	// Two counters that should only ever be seen
+	// as equal while holding the lock
+	struct Guarded
+	{
+		alloc::BiasedMutex	mutex;
+		int					a = 0;
+		int					b = 0;
+	};
+
+	TEST_METHOD(Owner_Only)
+	{
+		Guarded g;
+		Assert::IsTrue(g.mutex.isOwner());
+
+		for (int i = 0; i < 1000; ++i)
+		{
+			{
+				std::lock_guard lock(g.mutex);
+				++g.a;
+				++g.b;
+			}
+			std::shared_lock slock(g.mutex);
+			Assert::IsTrue(g.a == g.b);
+		}
+		Assert::IsTrue(g.a == 1000);
+	}
+
+	TEST_METHOD(Owner_And_Remotes)
+	{
+		constexpr int remotes	= 4;
+		constexpr int iters		= 2000;
+
+		Guarded g;
+		std::atomic<bool> mismatch = false;
+
+		auto writer = [&]()
+		{
+			for (int i = 0; i < iters; ++i)
+			{
+				std::lock_guard lock(g.mutex);
+				++g.a;
+				++g.b;
+			}
+		};
+
+		auto reader = [&]()
+		{
+			for (int i = 0; i < iters; ++i)
+			{
+				std::shared_lock lock(g.mutex);
+				if (g.a != g.b)
+					mismatch = true;
+			}
+		};
+
+		std::vector<std::thread> threads;
+		for (int i = 0; i < remotes; ++i)
+		{
+			threads.emplace_back(writer);
+			threads.emplace_back(reader);
+		}
+
+		// The owner mixes both
+		writer();
+		reader();
+
+		for (auto& th : threads)
+			th.join();
+
+		Assert::IsFalse(mismatch);
+		Assert::IsTrue(g.a == iters * (remotes + 1));
+		Assert::IsTrue(g.b == iters * (remotes + 1));
+	}
+
+	TEST_METHOD(Upgrade)
+	{
+		alloc::BiasedMutex mutex;
+		upgradeRace(mutex);
+	}
+
+	// One remote lock revokes the bias, a long enough run
+	// of owner only writes takes it back
+	TEST_METHOD(Revoke_And_Rebias)
+	{
+		alloc::BiasedMutex mutex;
+		Assert::IsTrue(mutex.biased());
+
+		std::thread([&]() { std::lock_guard lock(mutex); }).join();
+		Assert::IsFalse(mutex.biased());
+
+		std::thread([&]() { std::shared_lock lock(mutex); }).join();
+		Assert::IsFalse(mutex.biased());
+
+		for (uint32_t i = 0; i <= ImplBiasedMutex::REBIAS_AFTER; ++i)
+			std::lock_guard lock(mutex);
+		Assert::IsTrue(mutex.biased());
+
+		std::thread([&]() { std::shared_lock lock(mutex); }).join();
+		Assert::IsFalse(mutex.biased());
+	}
+};
+
+TEST_CLASS(SharedMutexTests)
+{
+public:
+
+	// More threads than flags (so some readers use the overflow shards)
+	// and more threads than cores, so waiters end up parked
+	template<class Mutex>
+	static void readersAndWriters()
+	{
+		constexpr int count = 16;
+		constexpr int iters = 2000;
+
+		Mutex				mutex{ 4 };
+		int					a = 0;
+		int					b = 0;
+		std::atomic<bool>	mismatch = false;
+
+		std::vector<std::thread> threads;
+		for (int t = 0; t < count; ++t)
+			threads.emplace_back([&, t]()
+			{
+				for (int i = 0; i < iters; ++i)
+				{
+					if (t % 4 == 0)
+					{
+						std::lock_guard lock(mutex);
+						++a;
+						++b;
+					}
+					else
+					{
+						std::shared_lock lock(mutex);
+						if (a != b)
+							mismatch = true;
+					}
+				}
+			});
+
+		for (auto& th : threads)
+			th.join();
+
+		Assert::IsFalse(mismatch);
+		Assert::IsTrue(a == iters * count / 4);
+		Assert::IsTrue(b == iters * count / 4);
+
+		const auto& stats = mutex.stats();
+		Assert::IsTrue(stats.contended > 0 || (stats.parks == 0 && stats.waitNanos == 0));
+	}
+
+	TEST_METHOD(Readers_And_Writers)
+	{
+		readersAndWriters<alloc::SharedMutex<>>();
+	}
+
+	TEST_METHOD(Reader_Preferring)
+	{
+		readersAndWriters<alloc::SharedMutex<0, alloc::ReaderPreferring>>();
+	}
+
+	TEST_METHOD(Phase_Fair)
+	{
+		readersAndWriters<alloc::SharedMutex<0, alloc::PhaseFair>>();
+
+		// A reader held up by a writer is counted as a retry
+		using namespace std::chrono_literals;
+		alloc::SharedMutex<4, alloc::PhaseFair> mutex;
+		mutex.lock();
+		std::thread reader([&]() { std::shared_lock lock(mutex); });
+		std::this_thread::sleep_for(10ms);
+		mutex.unlock();
+		reader.join();
+		Assert::IsTrue(mutex.stats().readerRetries > 0);
+	}
+
+	TEST_METHOD(Upgrade)
+	{
+		alloc::SharedMutex<4> mutex;
+		upgradeRace(mutex);
+
+		alloc::SharedMutex<4, alloc::PhaseFair> fair;
+		upgradeRace(fair);
+
+		// An upgrade holder keeps writers and other upgraders out, not readers
+		mutex.lock_upgrade();
+		bool results[3] = {};
+		std::thread([&]()
+		{
+			results[0] = !mutex.try_lock();
+			results[1] = !mutex.try_lock_upgrade();
+			results[2] = mutex.try_lock_shared();
+			if (results[2])
+				mutex.unlock_shared();
+		}).join();
+		mutex.unlock_upgrade();
+
+		for (bool r : results)
+			Assert::IsTrue(r);
+	}
+
+	TEST_METHOD(Numa_Aware)
+	{
+		readersAndWriters<alloc::SharedMutex<0, alloc::WriterPreferring, true>>();
+		readersAndWriters<alloc::SharedMutex<0, alloc::PhaseFair, true>>();
+	}
+
+	// With a single flag every other reader uses the overflow shards,
+	// they should still be able to hold the lock at the same time
+	TEST_METHOD(Overflow_Readers)
+	{
+		using namespace std::chrono_literals;
+		constexpr int count = 6;
+
+		alloc::SharedMutex<> defaulted;
+		Assert::IsTrue(defaulted.slotCount() == std::max(1u, std::thread::hardware_concurrency()));
+
+		alloc::SharedMutex<> mutex{ 1 };
+		Assert::IsTrue(mutex.slotCount() == 1);
+
+		std::atomic<int>	holding = 0;
+		std::atomic<bool>	together = true;
+
+		std::vector<std::thread> threads;
+		for (int t = 0; t < count; ++t)
+			threads.emplace_back([&]()
+			{
+				std::shared_lock lock(mutex);
+				++holding;
+
+				const auto deadline = std::chrono::steady_clock::now() + 5s;
+				while (holding < count)
+					if (std::chrono::steady_clock::now() > deadline)
+					{
+						together = false;
+						break;
+					}
+			});
+
+		for (auto& th : threads)
+			th.join();
+		Assert::IsTrue(together);
+
+		// And a writer still excludes them
+		std::unique_lock lock(mutex);
+		bool blocked = false;
+		std::thread([&]() { blocked = !mutex.try_lock_shared(); }).join();
+		Assert::IsTrue(blocked);
+	}
+
+	TEST_METHOD(Try_Locks)
+	{
+		using namespace std::chrono_literals;
+		alloc::SharedMutex<4> mutex;
+
+		// Run f on another thread so it gets its own flag
+		auto other = [](auto f)
+		{
+			bool r = false;
+			std::thread([&]() { r = f(); }).join();
+			return r;
+		};
+
+		{
+			std::shared_lock lock(mutex);
+			Assert::IsTrue(other([&]() { return !mutex.try_lock(); }));
+			Assert::IsTrue(other([&]() { return !mutex.try_lock_for(5ms); }));
+
+			// Shared locks still go through
+			Assert::IsTrue(other([&]()
+			{
+				if (!mutex.try_lock_shared_for(5ms))
+					return false;
+				mutex.unlock_shared();
+				return true;
+			}));
+		}
+
+		{
+			std::unique_lock lock(mutex, std::try_to_lock);
+			Assert::IsTrue(lock.owns_lock());
+
+			Assert::IsTrue(other([&]() { return !mutex.try_lock_shared(); }));
+			Assert::IsTrue(other([&]() { return !mutex.try_lock_shared_until(std::chrono::system_clock::now() + 5ms); }));
+
+			const auto start = std::chrono::steady_clock::now();
+			Assert::IsTrue(other([&]() { return !mutex.try_lock_until(std::chrono::steady_clock::now() + 20ms); }));
+			Assert::IsTrue(std::chrono::steady_clock::now() - start >= 20ms);
+		}
+
+		// A timed wait that gets the lock once the writer lets go
+		std::atomic<bool> locked = false;
+		mutex.lock();
+		std::thread waiter([&]()
+		{
+			std::shared_lock lock(mutex, 5s);
+			locked = lock.owns_lock();
+		});
+		std::this_thread::sleep_for(10ms);
+		mutex.unlock();
+		waiter.join();
+		Assert::IsTrue(locked);
+
+		Assert::IsTrue(mutex.try_lock());
+		mutex.unlock();
+	}
+};
+
+TEST_CLASS(ThreadRegistryTests)
+{
+public:
+
+	TEST_METHOD(Dense_And_Recycled)
+	{
+		constexpr int count = 8;
+
+		const size_t mine = alloc::ThreadRegistry::index();
+		Assert::IsTrue(mine == alloc::ThreadRegistry::index());
+
+		// Keep all the threads alive at once so none of them can share an index
+		std::vector<size_t>			indices(count);
+		std::atomic<int>			arrived = 0;
+		std::vector<std::thread>	threads;
+		for (int i = 0; i < count; ++i)
+			threads.emplace_back([&, i]()
+			{
+				indices[i] = alloc::ThreadRegistry::index();
+				++arrived;
+				while (arrived < count)
+					std::this_thread::yield();
+			});
+
+		for (auto& th : threads)
+			th.join();
+
+		std::sort(std::begin(indices), std::end(indices));
+		Assert::IsTrue(std::adjacent_find(std::begin(indices), std::end(indices)) == std::end(indices));
+		for (auto idx : indices)
+		{
+			Assert::IsTrue(idx != mine);
+			Assert::IsTrue(idx < alloc::ThreadRegistry::highWater());
+		}
+
+		// Every one of those threads has exited, so a new
+		// thread should get (at least) the lowest index back
+		size_t reused = 0;
+		std::thread([&]() { reused = alloc::ThreadRegistry::index(); }).join();
+		Assert::IsTrue(reused <= indices.front());
+	}
+
+	// Destroyed after the thread's registry Handle, since it was built before it
+	struct Late
+	{
+		inline static std::atomic<size_t> seen = 0;
+		~Late() { seen = alloc::ThreadRegistry::index(); }
+	};
+
+	TEST_METHOD(Index_After_Release)
+	{
+		size_t early = 0;
+		std::thread([&]()
+		{
+			thread_local Late late;
+			early = alloc::ThreadRegistry::index();
+		}).join();
+
+		// The index was already given back when Late asked,
+		// so it gets one of its own that's never recycled
+		const size_t late = Late::seen;
+		Assert::IsTrue(late != early);
+
+		size_t next = 0;
+		std::thread([&]() { next = alloc::ThreadRegistry::index(); }).join();
+		Assert::IsTrue(next != late);
+	}
+};
+
+}
@@ -2,6 +2,7 @@
 #include "stdafx.h"
 #include "CppUnitTest.h"
 #include "../Allocators/SlabMulti.h"
+#include "../Allocators/Vector.h"
 #include <vector>
 #include <map>
 #include <random>
@@ -127,6 +128,281 @@ public:
 		}
 	}
 
+	TEST_METHOD(Allocate_At_Least)
+	{
+		// Small request should be rounded up to the size of its cache
+		auto [ptr, n] = multi.allocate_at_least<size_t>(5);
+		Assert::IsTrue(n == ImplSlabMulti::SMALLEST_CACHE / sizeof(size_t));
+		Assert::IsTrue(multi.usable_size(ptr) == ImplSlabMulti::SMALLEST_CACHE);
+
+		// All of the slack should be usable
+		for (size_t i = 0; i < n; ++i)
+			ptr[i] = i;
+		for (size_t i = 0; i < n; ++i)
+			Assert::IsTrue(ptr[i] == i);
+
+		multi.deallocate(ptr, n);
+
+		// Requests larger than the largest cache aren't rounded
+		// and don't live in a Slab
+		constexpr size_t large	= ImplSlabMulti::LARGEST_CACHE / sizeof(size_t) + 1;
+		auto [lptr, ln]			= multi.allocate_at_least<size_t>(large);
+		Assert::IsTrue(ln == large);
+		Assert::IsTrue(multi.usable_size(lptr) == 0);
+		multi.deallocate(lptr, ln);
+	}
+
+	TEST_METHOD(Try_Expand)
+	{
+		// 3 size_t's live in the smallest cache, 
+		// so we should be able to grow to fill it
+		constexpr size_t perCache = ImplSlabMulti::SMALLEST_CACHE / sizeof(size_t);
+		size_t* ptr = multi.allocate<size_t>(3);
+		for (size_t i = 0; i < 3; ++i)
+			ptr[i] = i;
+
+		Assert::IsTrue(multi.try_expand(ptr, 3, perCache));
+		Assert::IsFalse(multi.try_expand(ptr, perCache, perCache + 1));
+
+		// Growing past the size class has to move the memory
+		size_t* moved = multi.reallocate(ptr, perCache, perCache * 4);
+		Assert::IsTrue(moved != ptr);
+		for (size_t i = 0; i < 3; ++i)
+			Assert::IsTrue(moved[i] == i);
+
+		multi.deallocate(moved, perCache * 4);
+	}
+
+	TEST_METHOD(Allocate_Zeroed)
+	{
+		// Dirty some blocks so the zeroed allocations
+		// below (most likely) reuse them
+		std::vector<size_t*> ptrs;
+		for (int i = 0; i < count; ++i)
+		{
+			ptrs.emplace_back(multi.allocate<size_t>(8));
+			std::memset(ptrs.back(), 0xFF, sizeof(size_t) * 8);
+		}
+		for (auto* p : ptrs)
+			multi.deallocate(p, 8);
+		ptrs.clear();
+
+		for (int i = 0; i < count; ++i)
+		{
+			ptrs.emplace_back(multi.allocate_zeroed<size_t>(8));
+			for (int j = 0; j < 8; ++j)
+				Assert::IsTrue(ptrs.back()[j] == 0);
+		}
+		for (auto* p : ptrs)
+			multi.deallocate(p, 8);
+
+		// Large blocks, both sides of the direct map size
+		for (size_t bytes : { ImplSlabMulti::LARGEST_CACHE * 2, ImplSlabMulti::DIRECT_MAP_SIZE * 2 })
+		{
+			const size_t n	= bytes / sizeof(size_t);
+			size_t* large	= multi.allocate_zeroed<size_t>(n);
+			for (size_t j = 0; j < n; ++j)
+				Assert::IsTrue(large[j] == 0);
+			multi.deallocate(large, n);
+		}
+	}
+
+	TEST_METHOD(Refiller)
+	{
+		using ImplSlabMulti::dispatcher;
+		constexpr size_t ready = 2 * ImplSlabMulti::GlobalDispatch::SLABS_PER_SUPERBLOCK;
+
+		decltype(multi)::setPrefault(true);
+		decltype(multi)::startRefiller(2);
+
+		auto waitReady = [&]()
+		{
+			for (int i = 0; i < 500 && dispatcher().freshBlocks() < ready; ++i)
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			return dispatcher().freshBlocks() >= ready;
+		};
+		Assert::IsTrue(waitReady());
+
+		// Use up more Slabs than the refiller had ready,
+		// it should top the pool back up afterwards.
+		// (the largest class that still uses single SLAB_SIZE Slabs)
+		constexpr int idx	= 3;
+		constexpr int bytes = ImplSlabMulti::cacheSizes[idx];
+		static_assert(ImplSlabMulti::spanOrders[idx] == 0);
+
+		std::vector<alloc::byte*> ptrs;
+		for (size_t i = 0; i < ready * 2 * ImplSlabMulti::blocksPerSlab[idx]; ++i)
+		{
+			ptrs.emplace_back(multi.allocate<alloc::byte>(bytes));
+			ptrs.back()[0] = 1;
+		}
+		Assert::IsTrue(waitReady());
+
+		decltype(multi)::stopRefiller();
+		decltype(multi)::setPrefault(false);
+
+		for (auto* p : ptrs)
+			multi.deallocate(p, bytes);
+	}
+
+	TEST_METHOD(Dispatch_Parallel)
+	{
+		using ImplSlabMulti::dispatcher;
+		constexpr int threads	= 8;
+		constexpr int perThread = 200;
+
+		// Hammer the lock free pool, no block should ever
+		// be handed to two threads at once
+		std::vector<std::future<std::vector<alloc::byte*>>> fvec;
+		for (int t = 0; t < threads; ++t)
+			fvec.emplace_back(std::async(std::launch::async, [&]()
+		{
+			std::vector<alloc::byte*> held;
+			for (int i = 0; i < perThread; ++i)
+			{
+				held.emplace_back(dispatcher().getBlock().first);
+				if (i % 3 == 0)
+				{
+					dispatcher().returnBlock(held.back());
+					held.pop_back();
+				}
+			}
+			return held;
+		}));
+
+		std::vector<alloc::byte*> all;
+		for (auto& f : fvec)
+			for (auto* b : f.get())
+				all.emplace_back(b);
+
+		std::sort(std::begin(all), std::end(all));
+		Assert::IsTrue(std::adjacent_find(std::begin(all), std::end(all)) == std::end(all));
+
+		for (auto* b : all)
+			dispatcher().returnBlock(b);
+	}
+
+	TEST_METHOD(Dispatch_Ordered)
+	{
+		using ImplSlabMulti::dispatcher;
+		constexpr int blocks = 100;
+
+		decltype(multi)::setAddressOrdered(true);
+
+		std::vector<alloc::byte*> held;
+		for (int i = 0; i < blocks; ++i)
+			held.emplace_back(dispatcher().getBlock().first);
+
+		std::shuffle(std::begin(held), std::end(held), std::default_random_engine{ 1 });
+		for (auto* b : held)
+			dispatcher().returnBlock(b);
+		held.clear();
+
+		// No matter what order they were returned in
+		// the lowest addresses should come back first
+		for (int i = 0; i < blocks; ++i)
+			held.emplace_back(dispatcher().getBlock().first);
+		Assert::IsTrue(std::is_sorted(std::begin(held), std::end(held)));
+
+		// Switching back migrates the free Slabs to the stacks
+		decltype(multi)::setAddressOrdered(false);
+		for (auto* b : held)
+			dispatcher().returnBlock(b);
+		Assert::IsTrue(dispatcher().getBlock().first == held.back());
+		dispatcher().returnBlock(held.back());
+	}
+
+	TEST_METHOD(Assign_And_Release)
+	{
+		using ImplSlabMulti::dispatcher;
+		alloc::byte* slab;
+		{
+			alloc::SlabMulti<size_t>	a;
+			alloc::SlabMulti<int>		b;
+			auto& self = a;
+
+			b = a;
+			a = self;
+			a = std::move(b);
+			Assert::IsTrue(a == b);
+
+			// The first block handed out is the start of a fresh Slab
+			size_t* ptr = a.allocate(1);
+			slab		= reinterpret_cast<alloc::byte*>(ptr);
+			a.deallocate(ptr, 1);
+		}
+
+		// The last reference is gone so every Cache should have handed its
+		// Slabs back. Single Slab blocks go on a stack, so ours are on top
+		const auto singles = std::count(std::begin(ImplSlabMulti::spanOrders), 
+			std::end(ImplSlabMulti::spanOrders), 0);
+
+		std::vector<alloc::byte*> held;
+		for (int i = 0; i < singles; ++i)
+			held.emplace_back(dispatcher().getBlock().first);
+
+		Assert::IsTrue(std::find(std::begin(held), std::end(held), slab) != std::end(held));
+		for (auto* b : held)
+			dispatcher().returnBlock(b);
+	}
+
+	TEST_METHOD(Span_Sizes)
+	{
+		// Every class should get a sensible number of blocks per Slab
+		for (int i = 0; i < ImplSlabMulti::NUM_CACHES; ++i)
+		{
+			Assert::IsTrue(ImplSlabMulti::blocksPerSlab[i] >= ImplSlabMulti::MIN_SLAB_BLOCKS);
+			Assert::IsTrue(ImplSlabMulti::blocksPerSlab[i] * ImplSlabMulti::cacheSizes[i] 
+				== ImplSlabMulti::SLAB_SIZE << ImplSlabMulti::spanOrders[i]);
+		}
+
+		// Blocks from the largest class live in multi Slab spans
+		std::vector<size_t*> ptrs;
+		constexpr size_t n = ImplSlabMulti::LARGEST_CACHE / sizeof(size_t);
+		for (int i = 0; i < ImplSlabMulti::blocksPerSlab.back() * 3; ++i)
+		{
+			ptrs.emplace_back(multi.allocate<size_t>(n));
+			ptrs.back()[0]		= i;
+			ptrs.back()[n - 1]	= i;
+			Assert::IsTrue(multi.usable_size(ptrs.back()) == ImplSlabMulti::LARGEST_CACHE);
+		}
+		for (size_t i = 0; i < ptrs.size(); ++i)
+		{
+			Assert::IsTrue(ptrs[i][0] == i && ptrs[i][n - 1] == i);
+			multi.deallocate(ptrs[i], n);
+		}
+	}
+
+	TEST_METHOD(Container_Vector)
+	{
+		alloc::Vector<TestStruct, decltype(multi)> vec(multi);
+
+		for (int i = 0; i < count; ++i)
+			vec.emplace_back(i);
+
+		for (int i = 0; i < count; ++i)
+			Assert::IsTrue(vec[i].i == i);
+
+		// The slack in the size class should be used
+		Assert::IsTrue(vec.capacity() * sizeof(TestStruct) % ImplSlabMulti::SMALLEST_CACHE == 0
+			|| vec.capacity() * sizeof(TestStruct) > ImplSlabMulti::LARGEST_CACHE);
+
+		while (vec.size() > 10)
+			vec.pop_back();
+		vec.shrink_to_fit();
+
+		// Shrinking to 10 elements still hands us the whole smallest cache
+		Assert::IsTrue(vec.capacity() == ImplSlabMulti::SMALLEST_CACHE / sizeof(TestStruct));
+		for (int i = 0; i < 10; ++i)
+			Assert::IsTrue(vec[i].i == i);
+
+		// Pushing one of our own elements while full has to copy it before growing
+		while (vec.size() < vec.capacity())
+			vec.emplace_back(1);
+		vec.push_back(vec[0]);
+		Assert::IsTrue(vec.back().i == 0);
+	}
+
 	template<class T>
 	std::pair<std::vector<AlRet<T>>, std::vector<std::vector<int>>> parallelAlloc(int threads)
 	{
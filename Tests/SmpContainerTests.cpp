@@ -0,0 +1,337 @@
+#include "stdafx.h"
+#include "CppUnitTest.h"
+#include "../Allocators/SmpContainer.h"
+#include "../Allocators/EpochReclaimer.h"
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <memory>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+
+namespace Tests
+{
+
+// Threads insert disjoint keys while the others look theirs back up,
+// references handed out by emplace have to survive everyone else's inserts
+template<class Policy>
+void emplaceFind()
+{
+	constexpr int threads	= 4;
+	constexpr int perThread	= 500;
+
+	alloc::SmpMap<size_t, size_t, Policy> map;
+	std::vector<std::thread> workers;
+	std::atomic<bool> bad = false;
+
+	for (int t = 0; t < threads; ++t)
+		workers.emplace_back([&, t]()
+		{
+			std::vector<size_t*> refs;
+			for (size_t i = 0; i < perThread; ++i)
+			{
+				const size_t key = i * threads + t;
+				refs.emplace_back(&map.emplace(key, key));
+
+				bool found = map.findDo(key, [&](auto it, auto& cont)
+				{
+					return it != std::end(cont) && it->second == key;
+				});
+				if (!found)
+					bad = true;
+			}
+
+			for (size_t i = 0; i < perThread; ++i)
+				if (*refs[i] != i * threads + t)
+					bad = true;
+		});
+
+	for (auto& w : workers)
+		w.join();
+
+	Assert::IsFalse(bad.load());
+	Assert::AreEqual(size_t{ threads * perThread }, map.size());
+
+	// emplace doesn't overwrite
+	Assert::AreEqual(size_t{ 5 }, map.emplace(5, 100));
+
+	size_t sum = 0;
+	map.iterate([&](auto& pair) -> bool
+	{
+		sum += pair.second;
+		return false;
+	});
+	const size_t n = threads * perThread;
+	Assert::AreEqual(n * (n - 1) / 2, sum);
+
+	Assert::IsTrue(map.erase(5));
+	Assert::IsFalse(map.erase(5));
+	Assert::AreEqual(n - 1, map.size());
+}
+
+TEST_CLASS(SmpMapTests)
+{
+public:
+
+	TEST_METHOD(Concurrent_Emplace_Find)
+	{
+		emplaceFind<alloc::LockPolicy>();
+	}
+
+	TEST_METHOD(Rcu_Emplace_Find)
+	{
+		emplaceFind<alloc::RcuPolicy>();
+	}
+
+	// Readers walk the map while a writer keeps adding and erasing
+	// one key. Erased values are poisoned by their destructor, a reader
+	// that can see one has been handed freed memory
+	TEST_METHOD(Rcu_Readers_Writer)
+	{
+		struct Value
+		{
+			size_t v;
+			Value(size_t v) : v{ v } {}
+			~Value() { v = 0; }
+		};
+
+		constexpr size_t keys = 64;
+		alloc::SmpMap<size_t, Value, alloc::RcuPolicy> map;
+		for (size_t i = 0; i < keys; ++i)
+			map.emplace(i, i + 1);
+
+		std::atomic<bool> done	= false;
+		std::atomic<bool> bad	= false;
+		std::vector<std::thread> readers;
+		for (int t = 0; t < 3; ++t)
+			readers.emplace_back([&]()
+			{
+				while (!done.load())
+				{
+					size_t seen = 0;
+					map.iterate([&](auto& pair) -> bool
+					{
+						if (pair.second.v != pair.first + 1)
+							bad = true;
+						++seen;
+						return false;
+					});
+					if (seen < keys)
+						bad = true;
+				}
+			});
+
+		for (int i = 0; i < 2000; ++i)
+		{
+			map.emplace(keys, keys + 1);
+			map.erase(keys);
+		}
+		done = true;
+		for (auto& r : readers)
+			r.join();
+
+		Assert::IsFalse(bad.load());
+		Assert::AreEqual(keys, map.size());
+	}
+};
+
+// Threads append while readers iterate, afterwards every value
+// has to be there exactly once
+template<class Policy>
+void appendIterate()
+{
+	constexpr size_t threads	= 4;
+	constexpr size_t perThread	= 5000;
+
+	alloc::SmpVector<size_t, Policy> vec;
+	std::atomic<bool> done		= false;
+	std::vector<std::thread> workers;
+
+	std::thread reader([&]()
+	{
+		while (!done.load())
+			vec.iterate([](size_t& v) { return v == size_t(-1); });
+	});
+
+	for (size_t t = 0; t < threads; ++t)
+		workers.emplace_back([&, t]()
+		{
+			for (size_t i = 0; i < perThread; ++i)
+				vec.emplace_back(i * threads + t);
+		});
+
+	for (auto& w : workers)
+		w.join();
+	done = true;
+	reader.join();
+
+	std::vector<int> seen(threads * perThread);
+	vec.iterate([&](size_t& v)
+	{
+		++seen[v];
+		return false;
+	});
+
+	Assert::AreEqual(threads * perThread, vec.size());
+	Assert::IsTrue(std::all_of(std::begin(seen), std::end(seen), [](int c) { return c == 1; }));
+}
+
+TEST_CLASS(SmpVectorTests)
+{
+public:
+
+	TEST_METHOD(Segmented_Append)
+	{
+		appendIterate<alloc::SegmentedPolicy<>>();
+	}
+
+	TEST_METHOD(Locked_Append)
+	{
+		appendIterate<alloc::LockPolicy>();
+	}
+
+	// References handed out by emplace_back stay put while the vector grows
+	TEST_METHOD(Segmented_Stable)
+	{
+		alloc::SmpVector<std::vector<int>, alloc::SegmentedPolicy<std::allocator<std::byte>>> vec;
+
+		std::vector<std::vector<int>*> refs;
+		for (int i = 0; i < 1000; ++i)
+			refs.emplace_back(&vec.emplace_back(3, i));
+
+		for (int i = 0; i < 1000; ++i)
+		{
+			Assert::IsTrue(refs[i] == &vec[i]);
+			Assert::AreEqual(i, vec[i][2]);
+		}
+	}
+};
+
+TEST_CLASS(EpochTests)
+{
+public:
+
+	// Nothing retired is freed while a Guard that could have seen it is still open
+	TEST_METHOD(Retire_Waits_For_Readers)
+	{
+		static std::atomic<int> freed;
+		freed = 0;
+		auto deleter = [](void* p)
+		{
+			++freed;
+			delete static_cast<int*>(p);
+		};
+
+		std::atomic<bool> entered	= false;
+		std::atomic<bool> leave		= false;
+		std::thread reader([&]()
+		{
+			alloc::Epoch::Guard guard;
+			entered = true;
+			while (!leave.load())
+				std::this_thread::yield();
+		});
+		while (!entered.load())
+			std::this_thread::yield();
+
+		alloc::Epoch::retire(new int{ 1 }, deleter);
+		for (int i = 0; i < 10; ++i)
+			alloc::Epoch::reclaim();
+		Assert::AreEqual(0, freed.load());
+
+		leave = true;
+		reader.join();
+		alloc::Epoch::synchronize();
+		Assert::AreEqual(1, freed.load());
+	}
+
+	// Writers swap a shared node and retire the old one while readers read it.
+	// Nodes are poisoned on destruction, so a reader that sees the poison read freed memory
+	TEST_METHOD(Reclaimer_Readers_Writers)
+	{
+		struct Node
+		{
+			size_t v;
+			Node(size_t v) : v{ v } {}
+			~Node() { v = 0; }
+		};
+
+		alloc::EpochReclaimer<Node>	reclaimer;
+		std::atomic<Node*>			shared = reclaimer.create(1);
+		std::atomic<bool>			done	= false;
+		std::atomic<bool>			bad		= false;
+
+		std::vector<std::thread> threads;
+		for (int t = 0; t < 3; ++t)
+			threads.emplace_back([&]()
+			{
+				while (!done.load())
+				{
+					alloc::Epoch::Guard guard;
+					if (!shared.load()->v)
+						bad = true;
+				}
+			});
+
+		std::vector<std::thread> writers;
+		for (int t = 0; t < 2; ++t)
+			writers.emplace_back([&]()
+			{
+				for (size_t i = 1; i < 5000; ++i)
+					reclaimer.retire(shared.exchange(reclaimer.create(i)));
+			});
+
+		for (auto& w : writers)
+			w.join();
+		done = true;
+		for (auto& t : threads)
+			t.join();
+
+		Assert::IsFalse(bad.load());
+		reclaimer.retire(shared.load());
+	}
+
+	// Once it's safe, a retired node is the next one handed out on the same thread
+	TEST_METHOD(Reclaimer_Reuse)
+	{
+		alloc::EpochReclaimer<size_t, std::allocator<size_t>> reclaimer;
+
+		size_t* node = reclaimer.create(5);
+		reclaimer.retire(node);
+		for (int i = 0; i < 3; ++i)
+			reclaimer.flush();
+
+		Assert::IsTrue(node == reclaimer.create(6));
+		Assert::AreEqual(size_t{ 6 }, *node);
+		reclaimer.retire(node);
+	}
+
+	// Whatever an exited thread still had retired is freed by whoever reclaims next
+	TEST_METHOD(Reclaimer_Thread_Exit)
+	{
+		static std::atomic<int> destroyed;
+		destroyed = 0;
+
+		struct Node
+		{
+			~Node() { ++destroyed; }
+		};
+
+		alloc::EpochReclaimer<Node, std::allocator<Node>> reclaimer;
+
+		// Fewer than a batch, so the thread never reclaims them itself
+		std::thread([&]()
+		{
+			for (int i = 0; i < 10; ++i)
+				reclaimer.retire(reclaimer.create());
+		}).join();
+		Assert::AreEqual(0, destroyed.load());
+
+		for (int i = 0; i < 3; ++i)
+			reclaimer.flush();
+		Assert::AreEqual(10, destroyed.load());
+	}
+};
+
+}